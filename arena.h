@@ -0,0 +1,139 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+/*
+ * Simple bump allocator.
+ *
+ * Memory comes from a chain of malloc()ed blocks and is only given back all
+ * at once. arena_reset() rewinds the arena but keeps its blocks, so an arena
+ * that is reset and refilled with the same allocations stops calling malloc()
+ * after the first round.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Alignment of every pointer arena_alloc() returns. Blocks come from
+   malloc(), which has to align at least this strictly (glibc's does). */
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+    struct arena_block *head;
+    struct arena_block *cur;
+    size_t block_size;      /* Minimum size of a new block */
+    unsigned long blocks;   /* Number of times malloc() has been called */
+};
+
+#define ARENA_INIT(block_size) { NULL, NULL, (block_size), 0 }
+
+/**
+ * arena_alloc - allocate memory from an arena
+ * @a: the arena.
+ * @size: number of bytes wanted.
+ * Returns NULL only if a new block was needed and malloc() failed.
+ */
+static inline void *
+arena_alloc(struct arena *a, size_t size) {
+    struct arena_block *b = a->cur;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    /* Move on through blocks kept from before the last reset first */
+    while (b && b->used + size > b->size) {
+        b = b->next;
+        if (b)
+            b->used = 0;
+    }
+
+    if (!b) {
+        size_t bsize = size > a->block_size ? size : a->block_size;
+
+        b = malloc(sizeof(struct arena_block) + bsize);
+        if (!b)
+            return NULL;
+        a->blocks++;
+        b->size = bsize;
+        b->used = 0;
+        if (a->cur) {
+            b->next = a->cur->next;
+            a->cur->next = b;
+        }
+        else {
+            b->next = a->head;
+            a->head = b;
+        }
+    }
+
+    a->cur = b;
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/**
+ * arena_reset - forget everything allocated from an arena
+ * @a: the arena.
+ * Blocks are kept for reuse by later allocations.
+ */
+static inline void
+arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->cur)
+        a->cur->used = 0;
+}
+
+/**
+ * arena_reserve - make sure an arena can hold @size bytes without malloc()
+ * @a: the arena.
+ * @size: total bytes the arena should be able to hand out after a reset.
+ * Resets the arena. Returns false if malloc() failed.
+ */
+static inline bool
+arena_reserve(struct arena *a, size_t size) {
+    arena_reset(a);
+    if (!arena_alloc(a, size))
+        return false;
+    arena_reset(a);
+    return true;
+}
+
+/**
+ * arena_size - bytes of memory held by an arena
+ * @a: the arena.
+ * Counts every block in full, however much of it is in use.
+ */
+static inline size_t
+arena_size(const struct arena *a) {
+    struct arena_block *b;
+    size_t size = 0;
+
+    for (b = a->head; b; b = b->next)
+        size += sizeof(struct arena_block) + b->size;
+    return size;
+}
+
+/**
+ * arena_free - give all of an arena's blocks back
+ * @a: the arena.
+ */
+static inline void
+arena_free(struct arena *a) {
+    struct arena_block *b, *next;
+
+    for (b = a->head; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->head = NULL;
+    a->cur = NULL;
+}
+
+#endif
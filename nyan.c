@@ -10,17 +10,51 @@
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
 #include <SDL/SDL_mixer.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #ifdef XINERAMA
 #include <X11/Xlib.h>
 #include <X11/extensions/Xinerama.h>
 #endif /* XINERAMA */
 #include "list.h" /* Linked list implementation */
+#include "ring.h" /* Lock-free SPSC queue */
+#include "arena.h" /* Bump allocator */
 
 #define BUF_SZ  1024
+#define DIR_SZ  992                 /* Leaves room for a file name in BUF_SZ */
+#define SHM_MAGIC       0x4e594132  /* "NYA2" */
+#define SHM_MAX_FRAMES  64
+#define SHM_LOCK_BUSY   0           /* Bytes of the segment used as fcntl() locks */
+#define SHM_LOCK_USERS  1
+#define CMD_SLOTS       64          /* Must be a power of two */
+#define CMD_STR_SZ      64
+#define CTRL_CLIENTS    8
+#define CTRL_LINE_SZ    256
+#define INPUT_POLL_MS   10
+#define QUALITY_DOWN_S  0.5         /* Seconds over budget before degrading */
+#define QUALITY_UP_S    3           /* Seconds well under budget before improving */
+#define QUALITY_UP_MAX  60          /* Longest that wait can back off to */
+#define WARMUP_STEPS    200
+#define TRACE_MAGIC     "nyancat-trace 2"
+#define FNV_OFFSET      0xcbf29ce484222325ULL
+#define FNV_PRIME       0x100000001b3ULL
+#define CAT_BOB         5           /* Frames 0 and 1 are drawn this much higher */
+#define MAX_SCREENS     16          /* Most layout entries read from a trace */
+#define SPARKLE_BAND    256         /* Rows of the spawn area simulated as one unit */
+#define MAX_THREADS     64
+#define BENCH_FRAMES    2000
+#define STRETCH_SLOTS   2           /* Full size frames kept in low memory mode */
+#define AUDIO_CHUNK     256         /* Samples per mixer buffer */
 
 /* Type definitions */
 typedef struct {
@@ -30,9 +64,20 @@ typedef struct {
 typedef struct cat_instance cat_instance;
 struct cat_instance {
     coords loc;
+    int drawn;                      /* Whether the last frame is still on screen */
+    int full;                       /* Redraw all of it this frame */
+    SDL_Rect* dirty;                /* Otherwise redraw these, relative to loc */
+    int ndirty;
     struct list_head list;
 };
 
+/* The columns of each row of the cat's area that differ from the previous
+   frame. Row 0 is CAT_BOB above the cat's position; left > right if none. */
+typedef struct {
+    int* left;
+    int* right;
+} frame_delta;
+
 typedef struct sparkle_instance sparkle_instance;
 struct sparkle_instance {
     unsigned int frame, speed;
@@ -42,32 +87,199 @@ struct sparkle_instance {
     struct list_head list;
 };
 
+/* A horizontal strip of the sparkle spawn area. Sparkles never change row,
+   so each band is updated on its own with its own random stream, spawn
+   counter and spare nodes, and which thread runs it makes no difference. */
+typedef struct {
+    int top, rows;                  /* Rows sparkles may spawn on */
+    int weight;                     /* Share of the screen height driving spawns */
+    unsigned int rng;               /* rand_r() state */
+    int spawn_counter;
+    unsigned int count;
+    unsigned int pooled;
+    struct list_head live;
+    struct list_head pool;
+} sparkle_band;
+
+/* Runtime commands, passed from the input thread to the render loop */
+typedef enum {
+    CMD_QUIT,
+    CMD_DENSITY,
+    CMD_FPS,
+    CMD_VOLUME,
+    CMD_DATASET
+} command_type;
+
+typedef struct {
+    command_type type;
+    int arg;
+    char str[CMD_STR_SZ];
+} command;
+
+typedef struct {
+    int fd;
+    int len;
+    char buf[CTRL_LINE_SZ];
+} control_client;
+
+/* One step of the adaptive quality governor. Level 0 is full quality. */
+typedef struct {
+    int density;                    /* Percent of the requested sparkle density */
+    unsigned int max_sparkles;      /* 0 for no limit */
+    int full_cat;                   /* Whether the stretched cat may be used */
+} quality_level;
+
+/* Bytes held by each part of the program. Deltas and sparkles are allocated
+   from the arenas; other is the rest of the arena blocks, used or not. */
+typedef struct {
+    unsigned long sprites;
+    unsigned long scaled;
+    unsigned long deltas;
+    unsigned long sparkles;
+    unsigned long audio;
+    unsigned long other;
+    unsigned long total;
+} memory_use;
+
+/* Published by the render loop once per frame, read by the control socket */
+typedef struct {
+    unsigned int frames;
+    unsigned int fps;
+    unsigned int frame_ms;
+    unsigned int sparkles;
+    unsigned int framerate;
+    int density;
+    int volume;
+    int quality;
+    unsigned int frame_avg_ms;
+    unsigned int sparkle_cap;
+    memory_use memory;
+    char data_set[CMD_STR_SZ];
+} render_stats;
+
+/* Stages timed for each frame in a trace */
+enum {
+    STAGE_CLEAR,
+    STAGE_UPDATE,
+    STAGE_SPARKLES,
+    STAGE_CATS,
+    STAGES
+};
+
+typedef enum {
+    TRACE_NONE,
+    TRACE_RECORD,
+    TRACE_REPLAY
+} trace_mode;
+
+/* What a settings file remembers about the machine it was written on: where
+   the data set was found, and the Xinerama layout of a display at a size */
+typedef struct {
+    char data_set[BUF_SZ];
+    char data_dir[DIR_SZ];
+    char display[BUF_SZ];
+    int w, h;
+    SDL_Rect layout[MAX_SCREENS];
+    int layout_n;
+} saved_probe;
+
+/* Layout of the shared asset segment. The header lives in its own page(s) so
+   that the pixel data that follows it can be mapped read-only. A write lock
+   on byte SHM_LOCK_BUSY serialises building, attaching and detaching, and
+   every instance using the segment holds a read lock on SHM_LOCK_USERS, so
+   only the last one out can write lock it. */
+typedef struct {
+    Uint32 w, h, pitch;
+    Uint32 offset;                  /* From the start of the data area */
+} shared_frame;
+
+typedef struct {
+    Uint32 magic;
+    Uint32 Rmask, Gmask, Bmask, Amask;
+    Uint32 frames_fg, frames_bg;
+    Uint32 music_offset, music_size;
+    Uint32 data_size;
+    shared_frame frames[SHM_MAX_FRAMES];
+} shared_header;
+
 /* Predecs */
-static void add_sparkle(void);
+static void add_sparkle(sparkle_band* b, unsigned int age);
+static void account_memory(memory_use* m);
 static void add_cat(unsigned int x, unsigned int y);
+static void apply_command(const command* cmd);
+static void apply_quality(void);
+static unsigned int band_limit(const sparkle_band* b, unsigned int total);
+static frame_delta* build_cat_deltas(SDL_Surface** set);
+static int cat_bob(int frame);
+static SDL_Surface* cat_frame(SDL_Surface** set, int i);
+static Uint32 cat_pixel(SDL_Surface* surf, int x, int y);
+static void cat_dirty(cat_instance* c);
+static void check_allocations(unsigned int frame);
 static void cleanup(void);
 static void clear_screen(void);
+static void control_command(int fd, char* line);
+static void control_open(void);
+static void count_sparkles(void);
+static int data_set_exists(const char* name);
+static int find_data_set(const char* name, char* dir);
 static void draw_cats(unsigned int frame);
 static void draw_sparkles(void);
-static void* ec_malloc(unsigned int size);
+static void* ec_alloc(struct arena* a, unsigned int size);
 static void errout(char *str);
 static void fillsquare(SDL_Surface* surf, int x, int y, int w, int h, Uint32 col);
+static Uint64 fnv1a(Uint64 hash, const void* data, size_t len);
+static void govern_quality(unsigned int frame_ms);
 static void handle_args(int argc, char** argv);
-static void handle_input(void);
+static void handle_commands(void);
+static void headless(void);
 static void init(void);
+static int input_thread(void* unused);
+static void load_config(int argc, char** argv);
+static void load_frames(void);
 static void load_images(void);
 static SDL_Surface* load_image(const char* path);
 static void load_resource_data(void);
 static void load_music(void);
+static unsigned char* map_resource(const char* name, Uint32* size);
+static Uint64 now_us(void);
+static void place_cats(void);
+static void print_memory(void);
+static void publish_stats(unsigned int frame_ms);
 static void putpix(SDL_Surface* surf, int x, int y, Uint32 col);
+static void query_layout(void);
+static void read_settings(FILE* f, saved_probe* probe);
+static void release_sparkles(void);
+static void reserve_sparkles(void);
+static void render_frame(Uint64* stage_us);
+static int replay(void);
 static void restart_music(void);
+static unsigned long rle_bytes(SDL_Surface* surf);
 static void run(void);
+static void run_benchmark(void);
+static Uint64 screen_hash(void);
+static void select_image_set(void);
+static void set_resolution(int w, int h);
+static int setting_value(const char* name, int n, int min, int max, int fallback);
+static void setup_bands(void);
+static unsigned int sparkle_cap(void);
+static Uint64 sparkle_hash(void);
+static int sparkle_worker(void* unused);
+static void spawn_sparkles(sparkle_band* b, unsigned int cap, unsigned int age);
+static int shared_attach(void);
+static int shared_build(int fd);
+static void shared_detach(void);
+static int shared_lock(short type, off_t byte, int wait);
 static void stretch_images(void);
+static void switch_data_set(const char* name);
+static void trace_begin(void);
+static void trace_load(void);
+static void unload_images(void);
+static void update_band(sparkle_band* b);
+static void update_bands(void);
 static void update_sparkles(void);
 static void usage(char* exname);
-#ifdef XINERAMA
-static void xinerama_add_cats(void);
-#endif /* XINERAMA */
+static void warmup_sparkles(void);
+static void write_config(void);
 
 /* Globals */
 static unsigned int                 FRAMERATE = 14;
@@ -76,81 +288,532 @@ static unsigned int                 SCREEN_WIDTH = 800;
 static unsigned int                 SCREEN_HEIGHT = 600;
 static SDL_Surface*                 screen = NULL;
 static SDL_Event                    event;
-static int                          running = 1;
+static volatile int                 running = 1;
 static int                          SURF_TYPE = SDL_HWSURFACE;
 static int                          sound = 1;
 static int                          sound_volume = 128;
 static int                          fullscreen = 1;
 static int                          catsize = 0;
 static int                          cursor = 0;
-#ifdef XINERAMA
-static Display*                     dpy;
-#endif /* XINERAMA */
+static int                          shared_assets = 0;
+static int                          pump_events = 0;
 static int                          curr_frame = 0;
-static int                          sparkle_spawn_counter = 0;
+static int                          sparkle_density = 100;
+static unsigned int                 sparkle_budget = 0;
+static int                          adaptive = 1;
+static int                          quality = 0;
+static float                        frame_avg = 0;
+static const quality_level          quality_levels[] = {
+    { 100,   0, 1 },
+    {  75, 400, 1 },
+    {  50, 200, 1 },
+    {  25, 100, 0 },
+    {  10,  50, 0 },
+};
+#define QUALITY_LEVELS (int) (sizeof(quality_levels) / sizeof(quality_level))
+static unsigned int                 sparkle_count = 0;
+static int                          field_w = 0;        /* Area the sparkles cross */
+static int                          field_h = 0;
+static sparkle_band*                bands = NULL;
+static int                          band_n = 0;
+static int                          threads = 0;
+static int                          worker_n = 0;
+static SDL_Thread*                  worker_tid[MAX_THREADS];
+static SDL_sem*                     work_sem = NULL;
+static SDL_sem*                     done_sem = NULL;
+static SDL_mutex*                   alloc_lock = NULL;
+static int                          next_band = 0;
+static volatile int                 workers_quit = 0;
+static int                          benchmark = 0;
+static SDL_Rect*                    layout = NULL;
+static int                          layout_n = 0;
+static SDL_Thread*                  input_tid = NULL;
+static struct ring                  cmd_ring;
+static command                      cmd_buf[CMD_SLOTS];
+static char*                        control_path = NULL;
+static int                          control_fd = -1;
+static render_stats                 stats;
+static unsigned int                 stats_seq = 0;
 static Mix_Music*                   music;
+static SDL_RWops*                   music_rw = NULL;
+static shared_header*               shm_hdr = NULL;
+static unsigned char*               shm_data = NULL;
+static size_t                       shm_hdr_size = 0;
+static int                          shm_fd = -1;
+static char                         shm_name[BUF_SZ];
+static trace_mode                   tracing = TRACE_NONE;
+static char*                        trace_path = NULL;
+static FILE*                        trace = NULL;
+static unsigned int                 trace_frames = 0;
+static unsigned int                 seed = 0;
+static int                          arg_count = 0;
+static char**                       arg_values = NULL;
 static SDL_Surface**                cat_img;
 static SDL_Surface**                sparkle_img;
 static SDL_Surface**                stretch_cat;
 static SDL_Surface**                image_set;
+static frame_delta*                 cat_delta = NULL;
+static frame_delta*                 small_delta = NULL;
+static frame_delta*                 full_delta = NULL;
+static int                          cat_deltas = 1;
+static int                          cats_overlap = 0;
+static int                          low_memory = 0;
+static int                          show_memory = 0;
+static int                          stretch_lru = 0;    /* Full size frames made on demand */
+static SDL_Surface*                 stretch_slot[STRETCH_SLOTS];
+static int                          slot_frame[STRETCH_SLOTS];
+static unsigned int                 slot_used[STRETCH_SLOTS];
+static unsigned int                 stretch_tick = 0;
+static unsigned long                sprite_bytes = 0;
+static unsigned long                scaled_bytes = 0;
+static unsigned long                delta_bytes = 0;
+static unsigned int                 sparkle_nodes = 0;
 static Uint32                       bgcolor;
 static char*                        RESOURCE_PATH = NULL;
+static char                         data_dir[DIR_SZ];   /* Where RESOURCE_PATH was found */
+static char*                        rc_path = NULL;
+static int                          rc_write = 0;
+static saved_probe                  cached;
 static char*                        LOC_BASE_PATH = "res";
 static char*                        OS_BASE_PATH = "/usr/share/nyancat";
 static int                          ANIM_FRAMES_FG = 0;
 static int                          ANIM_FRAMES_BG = 0;
-static LIST_HEAD(sparkle_list);
+static LIST_HEAD(sparkle_spare);    /* Nodes not yet given to a band */
 static LIST_HEAD(cat_list);
+/* Lives as long as the process, the current data set, and one frame */
+static struct arena                 startup_arena = ARENA_INIT(16384);
+static struct arena                 data_arena = ARENA_INIT(65536);
+static struct arena                 frame_arena = ARENA_INIT(65536);
+#ifdef DEBUG_ALLOC
+/* Heap allocations made by threads that render; the audio and input threads
+   don't set counting */
+static unsigned long                allocations = 0;
+static __thread int                 counting = 0;
+#endif /* DEBUG_ALLOC */
+static int                          settled = 0;    /* Passes since settings changed */
+
+/* Visit every live sparkle, band by band */
+#define for_each_sparkle(s, i) \
+    for (i = 0; i < band_n; ++i) \
+        list_for_each_entry(s, &bands[i].live, list)
+
+#ifdef DEBUG_ALLOC
+/* Stand in for glibc's allocator, so that allocations made inside SDL are
+   counted as well as our own */
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_malloc(size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void*
+calloc(size_t n, size_t size) {
+    if (counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void*
+malloc(size_t size) {
+    if (counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void*
+realloc(void* ptr, size_t size) {
+    if (counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif /* DEBUG_ALLOC */
 
 /* Function definitions */
 static void
-add_sparkle(void) {
+account_memory(memory_use* m) {
+    unsigned long arenas = arena_size(&startup_arena) + arena_size(&data_arena)
+                           + arena_size(&frame_arena);
+
+    m->sprites = sprite_bytes;
+    m->scaled = scaled_bytes;
+    m->deltas = delta_bytes;
+    m->sparkles = sparkle_nodes * sizeof(sparkle_instance) + band_n * sizeof(sparkle_band);
+
+    /* The mixer's 16 bit stereo buffer, and the Ogg if it is read from memory.
+       SDL_mixer's decoder state is its own business. */
+    m->audio = sound ? AUDIO_CHUNK * 4 : 0;
+    if (music_rw)
+        m->audio += shm_hdr->music_size;
+
+    m->other = arenas > m->deltas + m->sparkles ? arenas - m->deltas - m->sparkles : 0;
+    m->total = m->sprites + m->scaled + m->deltas + m->sparkles + m->audio + m->other;
+}
+
+/* Spawn a sparkle in @b in the state it would be in after @age calls to
+   update_sparkles(), or not at all if it would have left the screen by then */
+static void
+add_sparkle(sparkle_band* b, unsigned int age) {
     sparkle_instance* new;
+    int period = 2 * (ANIM_FRAMES_BG - 1);
+    int x, y, speed, layer, phase;
+
+    y = b->top + rand_r(&b->rng) % b->rows;
+    speed = 10 + (rand_r(&b->rng) % 30);
+    layer = rand_r(&b->rng) % 2;
+
+    x = field_w + 80 - speed * (int) age;
+    if (x < 0 - sparkle_img[0]->w)
+        return;
+
+    if (list_empty(&b->pool)) {
+        /* Other bands may be spawning at the same time */
+        SDL_mutexP(alloc_lock);
+        new = ec_alloc(&startup_arena, sizeof(sparkle_instance));
+        sparkle_nodes++;
+        SDL_mutexV(alloc_lock);
+    }
+    else {
+        new = list_entry(b->pool.next, sparkle_instance, list);
+        list_del(&new->list);
+        b->pooled--;
+    }
+    new->loc.x = x;
+    new->loc.y = y;
+    new->speed = speed;
+    new->layer = layer;
+
+    /* The frame bounces between 0 and ANIM_FRAMES_BG - 1 */
+    if (period > 0) {
+        phase = age % period;
+        new->frame = phase < ANIM_FRAMES_BG ? phase : period - phase;
+        new->frame_mov = phase < ANIM_FRAMES_BG - 1 ? 1 : -1;
+    }
+    else {
+        new->frame = 0;
+        new->frame_mov = 0;
+    }
 
-    new = ec_malloc(sizeof(sparkle_instance));
-    new->loc.x = screen->w + 80;
-    new->loc.y = (rand() % (screen->h + sparkle_img[0]->h)) - sparkle_img[0]->h;
-    new->frame = 0;
-    new->frame_mov = 1;
-    new->speed = 10 + (rand() % 30);
-    new->layer = rand() % 2;
-    list_add(&new->list, &sparkle_list);
+    list_add(&new->list, &b->live);
+    b->count++;
 }
 
 static void
 add_cat(unsigned int x, unsigned int y) {
     cat_instance* new;
 
-    new = ec_malloc(sizeof(cat_instance));
+    new = ec_alloc(&startup_arena, sizeof(cat_instance));
     new->loc.x = x;
     new->loc.y = y;
+    new->drawn = 0;
+    new->full = 1;
+    new->dirty = NULL;
+    new->ndirty = 0;
     list_add(&new->list, &cat_list);
 }
 
+static void
+apply_command(const command* cmd) {
+    settled = 0;
+    if (tracing == TRACE_RECORD)
+        fprintf(trace, "cmd %u %d %d %s\n", trace_frames, cmd->type, cmd->arg,
+                cmd->str[0] ? cmd->str : "-");
+
+    switch (cmd->type) {
+        case CMD_QUIT:
+            running = 0;
+            break;
+        case CMD_DENSITY:
+            sparkle_density = cmd->arg;
+            reserve_sparkles();
+            break;
+        case CMD_FPS:
+            FRAMERATE = cmd->arg;
+            break;
+        case CMD_VOLUME:
+            sound_volume = cmd->arg;
+            if (sound)
+                Mix_VolumeMusic(sound_volume);
+            break;
+        case CMD_DATASET:
+            switch_data_set(cmd->str);
+            break;
+    }
+}
+
+/* Bring the cat size in line with the current quality level */
+static void
+apply_quality(void) {
+    SDL_Surface** want = cat_img;
+
+    if (catsize == 1 && quality_levels[quality].full_cat)
+        want = stretch_cat;
+    if (want == image_set)
+        return;
+
+    image_set = want;
+    cat_delta = want == cat_img ? small_delta : full_delta;
+    settled = 0;
+    place_cats();
+    fillsquare(screen, 0, 0, screen->w, screen->h, bgcolor);
+}
+
+/* @b's part of @total, shared out by rows so that the parts add up to exactly
+   @total. A @total of 0 means no limit and gives UINT_MAX. */
+static unsigned int
+band_limit(const sparkle_band* b, unsigned int total) {
+    unsigned long long span = field_h + sparkle_img[0]->h;
+    unsigned long long from = b->top + sparkle_img[0]->h;
+
+    if (!total)
+        return UINT_MAX;
+    return total * (from + b->rows) / span - total * from / span;
+}
+
+/* Work out which parts of the cat's area change from each frame of @set to
+   the next, including the bob, so that only those need restoring and
+   blending. Each row is reduced to a single span of changed columns. */
+static frame_delta*
+build_cat_deltas(SDL_Surface** set) {
+    int w = set[0]->w;
+    int h = set[0]->h + CAT_BOB;
+    int t, prev, row, x;
+    frame_delta *deltas, *d;
+    SDL_Surface *before, *after;
+
+    if (!cat_deltas)
+        return NULL;
+
+    deltas = ec_alloc(&data_arena, sizeof(frame_delta) * ANIM_FRAMES_FG);
+    delta_bytes += sizeof(frame_delta) * ANIM_FRAMES_FG + sizeof(int) * 2 * h * ANIM_FRAMES_FG;
+
+    for (t = 0; t < ANIM_FRAMES_FG; ++t) {
+        prev = (t + ANIM_FRAMES_FG - 1) % ANIM_FRAMES_FG;
+        /* Only two frames need be around at once, even from the LRU */
+        before = cat_frame(set, prev);
+        after = cat_frame(set, t);
+        SDL_LockSurface(before);
+        SDL_LockSurface(after);
+        d = &deltas[t];
+        d->left = ec_alloc(&data_arena, sizeof(int) * h);
+        d->right = ec_alloc(&data_arena, sizeof(int) * h);
+
+        for (row = 0; row < h; ++row) {
+            d->left[row] = w;
+            d->right[row] = -1;
+            for (x = 0; x < w; ++x) {
+                if (cat_pixel(before, x, row - CAT_BOB - cat_bob(prev)) !=
+                    cat_pixel(after, x, row - CAT_BOB - cat_bob(t))) {
+                    if (x < d->left[row])
+                        d->left[row] = x;
+                    d->right[row] = x;
+                }
+            }
+        }
+        SDL_UnlockSurface(after);
+        SDL_UnlockSurface(before);
+    }
+    return deltas;
+}
+
+/* How far up or down a cat frame is drawn from the cat's position */
+static int
+cat_bob(int frame) {
+    return frame < 2 ? -CAT_BOB : 0;
+}
+
+/* Frame @i of @set. When stretch_lru is set the full size frames are made
+   on demand into the least recently used of STRETCH_SLOTS surfaces; every
+   entry of stretch_cat then points at a slot, for its size only. The
+   animation cycles, so a frame is stretched again each time it comes round;
+   the slots only let build_cat_deltas() hold a before and after pair and
+   every cat on the screen share the current frame. */
+static SDL_Surface*
+cat_frame(SDL_Surface** set, int i) {
+    int s, lru = 0;
+
+    if (set != stretch_cat || !stretch_lru)
+        return set[i];
+
+    stretch_tick++;
+    for (s = 0; s < STRETCH_SLOTS; ++s) {
+        if (slot_frame[s] == i) {
+            slot_used[s] = stretch_tick;
+            return stretch_slot[s];
+        }
+        if (slot_used[s] < slot_used[lru])
+            lru = s;
+    }
+
+    SDL_SoftStretch(cat_img[i], NULL, stretch_slot[lru], NULL);
+    slot_frame[lru] = i;
+    slot_used[lru] = stretch_tick;
+    return stretch_slot[lru];
+}
+
+/* A cat pixel as it affects the screen; fully transparent pixels are all the
+   same, and so are pixels off the top or bottom of the frame */
+static Uint32
+cat_pixel(SDL_Surface* surf, int x, int y) {
+    Uint32 amask = surf->format->Amask;
+    Uint32 pix;
+
+    if (y < 0 || y >= surf->h)
+        return 0;
+    pix = ((Uint32*) ((Uint8*) surf->pixels + y * surf->pitch))[x];
+    if (amask && !(pix & amask))
+        return 0;
+    return pix;
+}
+
+/* Work out what has to be restored and redrawn of a cat this frame: the
+   frame delta plus wherever a sparkle is cleared from or about to be drawn
+   over it. Keeping one span per row means nothing is blended twice. */
+static void
+cat_dirty(cat_instance* c) {
+    frame_delta* d = &cat_delta[curr_frame];
+    sparkle_instance *s;
+    int w = image_set[0]->w;
+    int h = image_set[0]->h + CAT_BOB;
+    int top = c->loc.y - CAT_BOB;
+    int row, first, last, left, right, i;
+    int* span_left = ec_alloc(&frame_arena, sizeof(int) * h);
+    int* span_right = ec_alloc(&frame_arena, sizeof(int) * h);
+    SDL_Rect* r;
+
+    memcpy(span_left, d->left, sizeof(int) * h);
+    memcpy(span_right, d->right, sizeof(int) * h);
+    c->dirty = ec_alloc(&frame_arena, sizeof(SDL_Rect) * h);
+
+    for_each_sparkle(s, i) {
+        /* Where it is now and where update_sparkles() will move it */
+        left = s->loc.x - (int) s->speed - c->loc.x;
+        right = s->loc.x + sparkle_img[0]->w - 1 - c->loc.x;
+        first = s->loc.y - top;
+        last = first + sparkle_img[0]->h - 1;
+        if (right < 0 || left >= w || last < 0 || first >= h)
+            continue;
+
+        if (left < 0)
+            left = 0;
+        if (right >= w)
+            right = w - 1;
+        if (first < 0)
+            first = 0;
+        if (last >= h)
+            last = h - 1;
+        for (row = first; row <= last; ++row) {
+            if (left < span_left[row])
+                span_left[row] = left;
+            if (right > span_right[row])
+                span_right[row] = right;
+        }
+    }
+
+    /* Merge runs of identical spans into rects */
+    c->ndirty = 0;
+    for (row = 0; row < h; ++row) {
+        if (span_right[row] < span_left[row])
+            continue;
+        r = &c->dirty[c->ndirty - 1];
+        if (c->ndirty && r->x == span_left[row] && r->w == span_right[row] - span_left[row] + 1
+                      && r->y + r->h == row - CAT_BOB)
+            r->h++;
+        else {
+            r = &c->dirty[c->ndirty++];
+            r->x = span_left[row];
+            r->y = row - CAT_BOB;
+            r->w = span_right[row] - span_left[row] + 1;
+            r->h = 1;
+        }
+    }
+}
+
+/* Called at the end of every pass of the render loop. A pass that changes
+   the settings may allocate, and so may the next, which draws with them
+   first; after that, under DEBUG_ALLOC, any allocation aborts. */
+static void
+check_allocations(unsigned int frame) {
+#ifdef DEBUG_ALLOC
+    static unsigned long last = 0;
+    unsigned long now = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+
+    if (settled > 1 && now != last) {
+        fprintf(stderr, "Render loop allocated memory in the steady state (frame %u)\n", frame);
+        abort();
+    }
+    last = now;
+    /* The first pass may allocate anyway, so start counting here */
+    counting = 1;
+#endif /* DEBUG_ALLOC */
+    if (settled < 2)
+        settled++;
+}
+
 static void
 cleanup(void) {
+    int i;
+
+    running = 0;
+    if (input_tid)
+        SDL_WaitThread(input_tid, NULL);
+
+    workers_quit = 1;
+    for (i = 0; i < worker_n; ++i)
+        SDL_SemPost(work_sem);
+    for (i = 0; i < worker_n; ++i)
+        SDL_WaitThread(worker_tid[i], NULL);
+    if (work_sem) {
+        SDL_DestroySemaphore(work_sem);
+        SDL_DestroySemaphore(done_sem);
+    }
+    if (alloc_lock)
+        SDL_DestroyMutex(alloc_lock);
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(control_path);
+    }
+
+    if (trace)
+        fclose(trace);
+
     Mix_HaltMusic();
     Mix_FreeMusic(music);
+    if (music_rw)
+        SDL_FreeRW(music_rw);
     Mix_CloseAudio();
     SDL_Quit();
+
+    arena_free(&frame_arena);
+    arena_free(&data_arena);
+    arena_free(&startup_arena);
 }
 
 static void
 clear_screen(void) {
     sparkle_instance *s;
     cat_instance *c;
+    SDL_Rect* r;
+    int i;
 
     list_for_each_entry(c, &cat_list, list) {
-        /* This is bad. These magic numbers are to make up for uneven image sizes */
-        fillsquare(screen,
-                   c->loc.x,
-                   c->loc.y - (curr_frame < 2 ? 0 : 5),
-                   image_set[curr_frame]->w + 6,
-                   image_set[curr_frame]->h + 5,
-                   bgcolor);
+        c->full = !cat_delta || !c->drawn || cats_overlap;
+        if (c->full) {
+            /* Covers the frame at both heights of the bob */
+            fillsquare(screen,
+                       c->loc.x,
+                       c->loc.y - CAT_BOB,
+                       image_set[curr_frame]->w,
+                       image_set[curr_frame]->h + CAT_BOB,
+                       bgcolor);
+            continue;
+        }
+
+        cat_dirty(c);
+        for (i = 0; i < c->ndirty; ++i) {
+            r = &c->dirty[i];
+            fillsquare(screen, c->loc.x + r->x, c->loc.y + r->y, r->w, r->h, bgcolor);
+        }
     }
 
-    list_for_each_entry(s, &sparkle_list, list) {
+    for_each_sparkle(s, i) {
         fillsquare(screen,
                    s->loc.x,
                    s->loc.y,
@@ -161,18 +824,128 @@ clear_screen(void) {
 
 }
 
+/* Parse one line from a control client. Anything that changes rendering is
+   queued for the render loop; stats are answered from the last snapshot. */
+static void
+control_command(int fd, char* line) {
+    char reply[BUF_SZ];
+    render_stats snap;
+    unsigned int seq;
+    command cmd;
+    int ok = 1;
+
+    memset(&cmd, 0, sizeof(command));
+    if (!strcmp(line, "quit"))
+        cmd.type = CMD_QUIT;
+    else if (sscanf(line, "density %d", &cmd.arg) == 1 && cmd.arg >= 0 && cmd.arg <= 1000)
+        cmd.type = CMD_DENSITY;
+    else if (sscanf(line, "fps %d", &cmd.arg) == 1 && cmd.arg > 0 && cmd.arg <= 100)
+        cmd.type = CMD_FPS;
+    else if (sscanf(line, "volume %d", &cmd.arg) == 1 && cmd.arg >= 0 && cmd.arg <= 128)
+        cmd.type = CMD_VOLUME;
+    else if (sscanf(line, "dataset %63s", cmd.str) == 1 && data_set_exists(cmd.str))
+        cmd.type = CMD_DATASET;
+    else if (!strcmp(line, "stats") || !strcmp(line, "memory")) {
+        do {
+            seq = __atomic_load_n(&stats_seq, __ATOMIC_ACQUIRE);
+            snap = stats;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != __atomic_load_n(&stats_seq, __ATOMIC_RELAXED));
+
+        if (!strcmp(line, "stats"))
+            snprintf(reply, BUF_SZ, "frames %u fps %u frame_ms %u frame_avg_ms %u sparkles %u "
+                     "sparkle_cap %u density %d quality %d framerate %u volume %d dataset %s\n",
+                     snap.frames, snap.fps, snap.frame_ms, snap.frame_avg_ms, snap.sparkles,
+                     snap.sparkle_cap, snap.density, snap.quality, snap.framerate, snap.volume,
+                     snap.data_set);
+        else
+            snprintf(reply, BUF_SZ, "sprites %lu scaled %lu deltas %lu sparkles %lu audio %lu "
+                     "other %lu total %lu\n",
+                     snap.memory.sprites, snap.memory.scaled, snap.memory.deltas,
+                     snap.memory.sparkles, snap.memory.audio, snap.memory.other,
+                     snap.memory.total);
+        send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+        return;
+    }
+    else
+        ok = 0;
+
+    if (!ok)
+        snprintf(reply, BUF_SZ, "error: bad command '%s'\n", line);
+    else if (!ring_push(&cmd_ring, &cmd))
+        snprintf(reply, BUF_SZ, "error: queue full\n");
+    else
+        snprintf(reply, BUF_SZ, "ok\n");
+    send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+static void
+control_open(void) {
+    struct sockaddr_un addr;
+
+    if (!control_path)
+        return;
+    if (strlen(control_path) >= sizeof(addr.sun_path)) {
+        puts("Control socket path is too long.");
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path);
+    unlink(control_path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_fd < 0 || bind(control_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+                       || listen(control_fd, CTRL_CLIENTS) < 0) {
+        perror("Unable to open control socket");
+        if (control_fd >= 0)
+            close(control_fd);
+        control_fd = -1;
+    }
+}
+
+static void
+count_sparkles(void) {
+    int i;
+
+    sparkle_count = 0;
+    for (i = 0; i < band_n; ++i)
+        sparkle_count += bands[i].count;
+}
+
+static int
+data_set_exists(const char* name) {
+    char dir[DIR_SZ];
+
+    return find_data_set(name, dir);
+}
+
 static void
 draw_cats(unsigned int frame) {
     cat_instance* c;
-    SDL_Rect pos;
+    SDL_Rect pos, src;
+    SDL_Rect* r;
+    int i;
 
     list_for_each_entry(c, &cat_list, list) {
-        pos.x = c->loc.x;
-        pos.y = c->loc.y;
+        c->drawn = 1;
+        if (c->full) {
+            pos.x = c->loc.x;
+            pos.y = c->loc.y + cat_bob(frame);
+            SDL_BlitSurface( cat_frame(image_set, frame), NULL, screen, &pos );
+            continue;
+        }
 
-        if(frame < 2)
-            pos.y -= 5;
-        SDL_BlitSurface( image_set[frame], NULL, screen, &pos );
+        /* Only what clear_screen() restored; SDL clips rows outside the frame */
+        for (i = 0; i < c->ndirty; ++i) {
+            r = &c->dirty[i];
+            src = *r;
+            src.y -= cat_bob(frame);
+            pos.x = c->loc.x + r->x;
+            pos.y = c->loc.y + r->y;
+            SDL_BlitSurface( cat_frame(image_set, frame), &src, screen, &pos );
+        }
     }
 }
 
@@ -180,8 +953,9 @@ static void
 draw_sparkles() {
     sparkle_instance* s;
     SDL_Rect pos;
+    int i;
 
-    list_for_each_entry(s, &sparkle_list, list) {
+    for_each_sparkle(s, i) {
         pos.x = s->loc.x;
         pos.y = s->loc.y;
         SDL_BlitSurface( sparkle_img[s->frame], NULL, screen, &pos );
@@ -189,11 +963,11 @@ draw_sparkles() {
 }
 
 static void*
-ec_malloc(unsigned int size) {
+ec_alloc(struct arena* a, unsigned int size) {
     void *ptr;
-    ptr = malloc(size);
+    ptr = arena_alloc(a, size);
     if (!ptr)
-        errout("In ec_malloc -- unable to allocate memory.");
+        errout("In ec_alloc -- unable to allocate memory.");
     return ptr;
 }
 
@@ -230,10 +1004,95 @@ fillsquare(SDL_Surface* surf, int x, int y, int w, int h, Uint32 col) {
             putpix(surf, i, e, col);
 }
 
+/* Put the directory holding data set @name in @dir (DIR_SZ bytes), looking
+   in the local res directory before the installed one. Returns 0 if neither
+   has it. */
+static int
+find_data_set(const char* name, char* dir) {
+    const char* bases[] = { LOC_BASE_PATH, OS_BASE_PATH };
+    char buffer[BUF_SZ];
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        snprintf(dir, DIR_SZ, "%s/%s", bases[i], name);
+        snprintf(buffer, BUF_SZ, "%s/data", dir);
+        if (!access(buffer, R_OK))
+            return 1;
+    }
+    return 0;
+}
+
+static Uint64
+fnv1a(Uint64 hash, const void* data, size_t len) {
+    const unsigned char* p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Adjust the quality level to hold the frame budget. Degrading is quick and
+   improving is slow, and the thresholds are far apart, so the level doesn't
+   flip back and forth around the budget. If a level that was just raised to
+   can't be held, the wait before trying it again doubles. */
+static void
+govern_quality(unsigned int frame_ms) {
+    static unsigned int over = 0;
+    static unsigned int under = 0;
+    static unsigned int since_up = 0;
+    static unsigned int up_wait = QUALITY_UP_S;
+    static int raised = 0;
+    float budget = 1000.0 / FRAMERATE;
+    int old = quality;
+
+    frame_avg += (frame_ms - frame_avg) / 8;
+    if (!adaptive)
+        return;
+
+    /* A raised level that has held as long as we waited for it is settled */
+    if (raised && ++since_up >= FRAMERATE * up_wait) {
+        raised = 0;
+        up_wait = QUALITY_UP_S;
+    }
+
+    if (frame_avg > budget * 0.9) {
+        under = 0;
+        if (++over >= FRAMERATE * QUALITY_DOWN_S && quality < QUALITY_LEVELS - 1) {
+            quality++;
+            if (raised)
+                up_wait = up_wait * 2 > QUALITY_UP_MAX ? QUALITY_UP_MAX : up_wait * 2;
+            raised = 0;
+        }
+    }
+    else if (frame_avg < budget * 0.5) {
+        over = 0;
+        if (++under >= FRAMERATE * up_wait && quality > 0) {
+            quality--;
+            raised = 1;
+            since_up = 0;
+        }
+    }
+    else
+        over = under = 0;
+
+    if (quality != old) {
+        over = under = 0;
+        apply_quality();
+        printf("Quality level %d: %d%% sparkles, limit %u, %s cat (%.1fms average, %.1fms budget)\n",
+               quality, quality_levels[quality].density, sparkle_cap(),
+               image_set == cat_img ? "small" : "full", frame_avg, budget);
+    }
+}
+
 static void
 handle_args(int argc, char **argv) {
     int i;
 
+    arg_count = argc;
+    arg_values = argv;
+
     /* This REALLY needs to be replaced with getopt */
 
     for (i = 1; i < argc; i++) {
@@ -243,7 +1102,7 @@ handle_args(int argc, char **argv) {
             SURF_TYPE = SDL_SWSURFACE;
         else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--fullscreen"))
             fullscreen = 1;
-        else if(!(strcmp(argv[i], "-nf") || !strcmp(argv[i], "--nofullscreen")))
+        else if(!strcmp(argv[i], "-nf") || !strcmp(argv[i], "--nofullscreen"))
             fullscreen = 0;
         else if(!strcmp(argv[i], "-nc") || !strcmp(argv[i], "--nocursor"))
             cursor = 0;
@@ -251,6 +1110,41 @@ handle_args(int argc, char **argv) {
             cursor = 1;
         else if(!strcmp(argv[i], "-ns") || !strcmp(argv[i], "--nosound"))
             sound = 0;
+        else if(!strcmp(argv[i], "-nd") || !strcmp(argv[i], "--nodelta"))
+            cat_deltas = 0;
+        else if(!strcmp(argv[i], "-sh") || !strcmp(argv[i], "--shared"))
+            shared_assets = 1;
+        else if(!strcmp(argv[i], "-na") || !strcmp(argv[i], "--noadaptive"))
+            adaptive = 0;
+        else if((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--budget")) && i < argc - 1)
+            sparkle_budget = atoi(argv[++i]);
+        else if((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) && i < argc - 1) {
+            threads = atoi(argv[++i]);
+            if (threads < 0 || threads > MAX_THREADS) {
+                printf("Thread count must be from 0 to %d. Using one.\n", MAX_THREADS);
+                threads = 1;
+            }
+            else if (!threads)
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else if(!strcmp(argv[i], "-bm") || !strcmp(argv[i], "--benchmark"))
+            benchmark = 1;
+        else if(!strcmp(argv[i], "-lm") || !strcmp(argv[i], "--lowmem"))
+            low_memory = 1;
+        else if(!strcmp(argv[i], "-m") || !strcmp(argv[i], "--memory"))
+            show_memory = 1;
+        else if((!strcmp(argv[i], "-rec") || !strcmp(argv[i], "--record")) && i < argc - 1) {
+            tracing = TRACE_RECORD;
+            trace_path = argv[++i];
+        }
+        else if((!strcmp(argv[i], "-rep") || !strcmp(argv[i], "--replay")) && i < argc - 1) {
+            tracing = TRACE_REPLAY;
+            trace_path = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-s") || !strcmp(argv[i], "--socket")) {
+            if (++i < argc)
+                control_path = argv[i];
+        }
         else if((!strcmp(argv[i], "-v") || !strcmp(argv[i], "--volume")) && i < argc - 1) {
             int vol = atoi(argv[++i]);
             if(vol >= 0 && vol <= 128){
@@ -274,55 +1168,71 @@ handle_args(int argc, char **argv) {
             }
         }
         else if(!strcmp(argv[i], "-d") || !strcmp(argv[i], "--data-set")) {
-            if (++i < argc) {
-                if (RESOURCE_PATH)
-                    free(RESOURCE_PATH);
-                RESOURCE_PATH = strdup(argv[i]);
-            }
+            if (++i < argc)
+                RESOURCE_PATH = argv[i];
         }
-        else if((!strcmp(argv[i], "-r") && strcmp(argv[i], "--resolution")) && i < argc - 2) {
-            int dims[2] = { atoi(argv[++i]), atoi(argv[++i]) };
-            if (dims[0] >= 0 && dims[0] < 10000 && dims[1] >= 0 && dims[1] < 5000) {           // Borrowed from PixelUnsticker, changed the variable name
-                SCREEN_WIDTH = dims[0];
-                SCREEN_HEIGHT = dims[1];
-            }
-            else
-                puts("Arguments do not appear to be valid screen sizes. Defaulting.");
+        else if((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--resolution")) && i < argc - 2) {
+            set_resolution(atoi(argv[i + 1]), atoi(argv[i + 2]));
+            i += 2;
         }
+        else if((!strcmp(argv[i], "-rc") || !strcmp(argv[i], "--config")) && i < argc - 1)
+            i++;    /* Already read by load_config() */
+        else if(!strcmp(argv[i], "-nrc") || !strcmp(argv[i], "--noconfig"))
+            ;
+        else if(!strcmp(argv[i], "-wc") || !strcmp(argv[i], "--write-config"))
+            rc_write = 1;
         else
             printf("Unrecognised option: %s\n", argv[i]);
     }
 
     if (!RESOURCE_PATH)
         RESOURCE_PATH = "default";
+
+    /* The benchmark defaults to trying every core */
+    if (threads <= 0)
+        threads = benchmark ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
 }
 
+/* Apply everything the input thread queued since the last frame */
 static void
-handle_input(void) {
-    while( SDL_PollEvent( &event ) ) {
-        switch (event.type) {
-            case SDL_KEYDOWN:
-            case SDL_QUIT:
-            case SDL_MOUSEMOTION:
-                running = 0;
-                break;
-        }
-    }
+handle_commands(void) {
+    command cmd;
+
+    while (ring_pop(&cmd_ring, &cmd))
+        apply_command(&cmd);
 }
 
+/* Nothing may depend on the display or the clock */
 static void
-init(void) {
-    int i;
-
-    srand( time(NULL) );
+headless(void) {
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    fullscreen = 0;
+    SURF_TYPE = SDL_SWSURFACE;
+    sound = 0;
+}
 
-    SDL_Init( SDL_INIT_EVERYTHING );
+static void
+init(void) {
+    if (!seed)
+        seed = time(NULL);
+    srand( seed );
+
+    /* Input is handled off the main thread where SDL can deliver events there */
+    if (SDL_Init( SDL_INIT_EVERYTHING | SDL_INIT_EVENTTHREAD ) < 0) {
+        SDL_Quit();
+        SDL_Init( SDL_INIT_EVERYTHING );
+        pump_events = 1;
+    }
     if (fullscreen)
         screen = SDL_SetVideoMode( 0, 0, SCREEN_BPP, SURF_TYPE | SDL_FULLSCREEN );
     else
         screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SURF_TYPE );
     if(!cursor)
         SDL_ShowCursor(0);
+    field_w = screen->w;
+    field_h = screen->h;
 
     load_resource_data();
     load_images();
@@ -330,68 +1240,165 @@ init(void) {
     fillsquare(screen, 0, 0, screen->w, screen->h, bgcolor);
 
     if(sound) {
-        Mix_OpenAudio( 44100, AUDIO_S16, 2, 256 );
+        Mix_OpenAudio( 44100, AUDIO_S16, 2, AUDIO_CHUNK );
         load_music();
         Mix_PlayMusic(music, 0);
         Mix_VolumeMusic(sound_volume);
     }
 
-    /* Choose our image set */
-    if (catsize == 1)
-        image_set = stretch_cat;
-    else
-        image_set = cat_img;
-
-/* Ugly */
-#ifdef XINERAMA
-    if (!(dpy = XOpenDisplay(NULL)))
-        puts("Failed to open Xinerama display information.");
-    else{
-        if(catsize == 1)
-            stretch_images();
-        xinerama_add_cats();
-        XCloseDisplay(dpy);
-    }
-#else
-    if(catsize == 1)
-        add_cat(0, (screen->h - image_set[0]->h) / 2);
-    else {
-        add_cat((screen->w - cat_img[0]->w) / 2, (screen->h - cat_img[0]->h) / 2);
-    }
-#endif /* Xinerama */
+    query_layout();
+    select_image_set();
+    place_cats();
 
     /* clear initial input */
     while( SDL_PollEvent( &event ) ) {}
 
-    /* Pre-populate with sparkles */
-    for (i = 0; i < 200; i++)
-        update_sparkles();
+    alloc_lock = SDL_CreateMutex();
+    if (threads > 1) {
+        work_sem = SDL_CreateSemaphore(0);
+        done_sem = SDL_CreateSemaphore(0);
+        for (worker_n = 0; worker_n < threads - 1; ++worker_n) {
+            worker_tid[worker_n] = SDL_CreateThread(sparkle_worker, NULL);
+            if (!worker_tid[worker_n])
+                errout("Unable to start sparkle worker thread.");
+        }
+    }
+
+    setup_bands();
+    warmup_sparkles();
+    reserve_sparkles();
+    if (tracing == TRACE_RECORD)
+        trace_begin();
+
+    ring_init(&cmd_ring, cmd_buf, sizeof(command), CMD_SLOTS);
+    control_open();
+    input_tid = SDL_CreateThread(input_thread, NULL);
+    if (!input_tid)
+        errout("Unable to start input thread.");
+
+    if (rc_write)
+        write_config();
+    if (show_memory)
+        print_memory();
 }
 
+/* Owns SDL event handling and the control socket. Never touches rendering
+   state directly; everything goes through cmd_ring. */
+static int
+input_thread(void* unused) {
+    control_client clients[CTRL_CLIENTS];
+    struct pollfd fds[CTRL_CLIENTS + 1];
+    SDL_Event ev;
+    command cmd;
+    char* nl;
+    int nclients = 0;
+    int nfds, fd, n, i;
+
+    memset(&cmd, 0, sizeof(command));
+    while (running) {
+        nfds = 0;
+        if (control_fd >= 0) {
+            fds[nfds].fd = control_fd;
+            fds[nfds++].events = POLLIN;
+            for (i = 0; i < nclients; ++i) {
+                fds[nfds].fd = clients[i].fd;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+
+        if (poll(fds, nfds, INPUT_POLL_MS) > 0) {
+            /* Clients first, so that indices still line up with fds */
+            for (i = nclients - 1; i >= 0; --i) {
+                if (!fds[i + 1].revents)
+                    continue;
+                control_client* c = &clients[i];
+                n = read(c->fd, c->buf + c->len, CTRL_LINE_SZ - 1 - c->len);
+                if (n <= 0) {
+                    close(c->fd);
+                    clients[i] = clients[--nclients];
+                    continue;
+                }
+                c->len += n;
+                c->buf[c->len] = '\0';
+                while ((nl = strchr(c->buf, '\n'))) {
+                    *nl = '\0';
+                    if (nl > c->buf && nl[-1] == '\r')
+                        nl[-1] = '\0';
+                    control_command(c->fd, c->buf);
+                    c->len -= nl + 1 - c->buf;
+                    memmove(c->buf, nl + 1, c->len + 1);
+                }
+                if (c->len == CTRL_LINE_SZ - 1)
+                    c->len = 0;
+            }
+            if (fds[0].revents & POLLIN) {
+                fd = accept(control_fd, NULL, NULL);
+                if (fd >= 0 && nclients < CTRL_CLIENTS) {
+                    clients[nclients].fd = fd;
+                    clients[nclients++].len = 0;
+                }
+                else if (fd >= 0)
+                    close(fd);
+            }
+        }
+
+        while (SDL_PeepEvents(&ev, 1, SDL_GETEVENT, SDL_ALLEVENTS) > 0) {
+            switch (ev.type) {
+                case SDL_KEYDOWN:
+                case SDL_QUIT:
+                case SDL_MOUSEMOTION:
+                    cmd.type = CMD_QUIT;
+                    ring_push(&cmd_ring, &cmd);
+                    break;
+            }
+        }
+    }
+
+    for (i = 0; i < nclients; ++i)
+        close(clients[i].fd);
+    return 0;
+}
+
+/* Apply the settings file before the command line, which overrides it.
+   --config picks another file and --noconfig ignores it; replays ignore it
+   too, so that they depend only on the trace. */
 static void
-load_images(void) {
+load_config(int argc, char** argv) {
+    const char* home = getenv("HOME");
+    FILE* f;
+    int i, skip = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if ((!strcmp(argv[i], "-rc") || !strcmp(argv[i], "--config")) && i < argc - 1)
+            rc_path = argv[++i];
+        else if (!strcmp(argv[i], "-nrc") || !strcmp(argv[i], "--noconfig")
+                 || !strcmp(argv[i], "-rep") || !strcmp(argv[i], "--replay"))
+            skip = 1;
+    }
+
+    if (!rc_path && home) {
+        rc_path = ec_alloc(&startup_arena, strlen(home) + strlen("/.nyancatrc") + 1);
+        sprintf(rc_path, "%s/.nyancatrc", home);
+    }
+    if (skip || !rc_path || !(f = fopen(rc_path, "r")))
+        return;
+    read_settings(f, &cached);
+    fclose(f);
+}
+
+static void
+load_frames(void) {
     int i;
     char buffer[BUF_SZ];
 
-    cat_img = ec_malloc(sizeof(SDL_Surface*) * ANIM_FRAMES_FG);
-    sparkle_img = ec_malloc(sizeof(SDL_Surface*) * ANIM_FRAMES_BG);
-
     /* Loading logic */
     for (i = 0; i < ANIM_FRAMES_FG; ++i) {
-        snprintf(buffer, BUF_SZ, "%s/%s/fg%02d.png", LOC_BASE_PATH, RESOURCE_PATH, i);
+        snprintf(buffer, BUF_SZ, "%s/fg%02d.png", data_dir, i);
         cat_img[i] = load_image(buffer);
-        if (!cat_img[i]) {
-            snprintf(buffer, BUF_SZ, "%s/%s/fg%02d.png", OS_BASE_PATH, RESOURCE_PATH, i);
-            cat_img[i] = load_image(buffer);
-        }
     }
     for (i = 0; i < ANIM_FRAMES_BG; ++i) {
-        snprintf(buffer, BUF_SZ, "%s/%s/bg%02d.png", LOC_BASE_PATH, RESOURCE_PATH, i);
+        snprintf(buffer, BUF_SZ, "%s/bg%02d.png", data_dir, i);
         sparkle_img[i] = load_image(buffer);
-        if (!sparkle_img[i]) {
-            snprintf(buffer, BUF_SZ, "%s/%s/bg%02d.png", OS_BASE_PATH, RESOURCE_PATH, i);
-            sparkle_img[i] = load_image(buffer);
-        }
     }
 
     /* Check everything loaded properly */
@@ -404,6 +1411,41 @@ load_images(void) {
             errout("Error loading background images.");
 }
 
+static void
+load_images(void) {
+    SDL_Surface* surf;
+    int i;
+
+    cat_img = ec_alloc(&data_arena, sizeof(SDL_Surface*) * ANIM_FRAMES_FG);
+    sparkle_img = ec_alloc(&data_arena, sizeof(SDL_Surface*) * ANIM_FRAMES_BG);
+
+    if (!shared_assets || !shared_attach())
+        load_frames();
+
+    /* Low memory mode keeps a few full size frames, stretched as cat_frame()
+       needs them */
+    stretch_lru = low_memory && catsize == 1 && ANIM_FRAMES_FG > STRETCH_SLOTS;
+
+    /* SDL keeps RLE surfaces as runs of visible pixels and decodes them as it
+       blits. Shared surfaces would keep their pixels as well, so are left.
+       So are cat frames that cat_frame() stretches from while drawing: locking
+       an RLE surface decodes it into a new buffer and encodes it again. */
+    sprite_bytes = 0;
+    for (i = 0; i < ANIM_FRAMES_FG + ANIM_FRAMES_BG; ++i) {
+        surf = i < ANIM_FRAMES_FG ? cat_img[i] : sparkle_img[i - ANIM_FRAMES_FG];
+        if (low_memory && !shm_hdr && !(stretch_lru && i < ANIM_FRAMES_FG)) {
+            /* SDL encodes on the first blit, for the surface blitted to, and
+               that allocates. Do it now on the screen, which the caller
+               clears, rather than when the animation first reaches it. */
+            SDL_SetAlpha(surf, SDL_SRCALPHA | SDL_RLEACCEL, SDL_ALPHA_OPAQUE);
+            SDL_BlitSurface(surf, NULL, screen, NULL);
+            sprite_bytes += rle_bytes(surf);
+        }
+        else
+            sprite_bytes += surf->h * surf->pitch;
+    }
+}
+
 static SDL_Surface*
 load_image( const char* path ) {
     SDL_Surface* loadedImage = NULL;
@@ -421,12 +1463,20 @@ static void
 load_music(void) {
     char buffer[BUF_SZ];
 
-    snprintf(buffer, BUF_SZ, "%s/%s/music.ogg", LOC_BASE_PATH, RESOURCE_PATH);
-    music = Mix_LoadMUS(buffer);
-    if (!music) {
-        snprintf(buffer, BUF_SZ, "%s/%s/music.ogg", OS_BASE_PATH, RESOURCE_PATH);
-        music = Mix_LoadMUS(buffer);
+    /* In low memory mode the Ogg is always streamed from its file */
+    if (shm_hdr && shm_hdr->music_size && !low_memory) {
+        music_rw = SDL_RWFromConstMem(shm_data + shm_hdr->music_offset, shm_hdr->music_size);
+        music = Mix_LoadMUS_RW(music_rw);
+        if (music) {
+            Mix_HookMusicFinished(restart_music);
+            return;
+        }
+        SDL_FreeRW(music_rw);
+        music_rw = NULL;
     }
+
+    snprintf(buffer, BUF_SZ, "%s/music.ogg", data_dir);
+    music = Mix_LoadMUS(buffer);
     if (!music)
         printf("Unable to load Ogg file: %s\n", Mix_GetError());
     else
@@ -438,10 +1488,16 @@ load_resource_data(void) {
     FILE *f;
     char buffer[BUF_SZ];
 
-    snprintf(buffer, BUF_SZ, "%s/%s/data", LOC_BASE_PATH, RESOURCE_PATH);
-    f = fopen(buffer, "r");
-    if (!f) {
-        snprintf(buffer, BUF_SZ, "%s/%s/data", OS_BASE_PATH, RESOURCE_PATH);
+    /* Trust where the settings file says the data set is, unless it moved */
+    if (cached.data_dir[0] && !strcmp(cached.data_set, RESOURCE_PATH))
+        strcpy(data_dir, cached.data_dir);
+    else
+        data_dir[0] = '\0';
+
+    snprintf(buffer, BUF_SZ, "%s/data", data_dir);
+    f = data_dir[0] ? fopen(buffer, "r") : NULL;
+    if (!f && find_data_set(RESOURCE_PATH, data_dir)) {
+        snprintf(buffer, BUF_SZ, "%s/data", data_dir);
         f = fopen(buffer, "r");
     }
     if (!f)
@@ -449,35 +1505,445 @@ load_resource_data(void) {
 
     ANIM_FRAMES_FG = atoi(fgets(buffer, BUF_SZ, f));
     ANIM_FRAMES_BG = atoi(fgets(buffer, BUF_SZ, f));
+    fclose(f);
 
     if (!ANIM_FRAMES_FG || !ANIM_FRAMES_BG)
         errout("Error reading resource data file.");
 }
 
+static Uint64
+now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Map a whole file from the data set into memory, or return NULL. Release
+   it with munmap(). */
+static unsigned char*
+map_resource(const char* name, Uint32* size) {
+    char buffer[BUF_SZ];
+    unsigned char* mem;
+    struct stat st;
+    int fd;
+
+    snprintf(buffer, BUF_SZ, "%s/%s", data_dir, name);
+    fd = open(buffer, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return mem;
+}
+
+/* Centre a cat in each area of the layout. The cats themselves are created
+   once and only moved after that. */
+static void
+place_cats(void) {
+    cat_instance *c, *other;
+    int i;
+
+    if (list_empty(&cat_list))
+        for (i = 0; i < layout_n; ++i)
+            add_cat(0, 0);
+
+    /* list_add() puts the newest first */
+    i = layout_n;
+    list_for_each_entry(c, &cat_list, list) {
+        --i;
+        c->loc.x = layout[i].x + (layout[i].w - image_set[0]->w) / 2;
+        c->loc.y = layout[i].y + (layout[i].h - image_set[0]->h) / 2;
+        c->drawn = 0;
+    }
+
+    /* Partial redraws assume nothing else is drawn over a cat */
+    cats_overlap = 0;
+    list_for_each_entry(c, &cat_list, list)
+        list_for_each_entry(other, &cat_list, list)
+            if (c != other && abs(c->loc.x - other->loc.x) < image_set[0]->w &&
+                abs(c->loc.y - other->loc.y) < image_set[0]->h + CAT_BOB)
+                cats_overlap = 1;
+}
+
+static void
+print_memory(void) {
+    memory_use m;
+
+    account_memory(&m);
+    printf("Memory in use (bytes):\n"
+           "  sprites         %10lu%s\n"
+           "  scaled copies   %10lu%s\n"
+           "  cat deltas      %10lu\n"
+           "  sparkle pool    %10lu (%u sparkles)\n"
+           "  audio buffers   %10lu\n"
+           "  other           %10lu\n"
+           "  total           %10lu\n",
+           m.sprites, shm_hdr ? " (shared)" : !low_memory ? "" :
+           stretch_lru ? " (sparkles RLE, estimated)" : " (RLE, estimated)",
+           m.scaled, stretch_lru ? " (on demand)" : "",
+           m.deltas, m.sparkles, sparkle_nodes, m.audio, m.other, m.total);
+}
+
+static void
+publish_stats(unsigned int frame_ms) {
+    static unsigned int fps_start = 0;
+    static unsigned int fps_frames = 0;
+    unsigned int now = SDL_GetTicks();
+
+    fps_frames++;
+    if (now - fps_start >= 1000) {
+        stats.fps = fps_frames * 1000 / (now - fps_start);
+        fps_start = now;
+        fps_frames = 0;
+    }
+
+    /* Odd sequence numbers tell readers a write is in progress */
+    __atomic_store_n(&stats_seq, stats_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    stats.frames++;
+    stats.frame_ms = frame_ms;
+    stats.sparkles = sparkle_count;
+    stats.framerate = FRAMERATE;
+    stats.density = sparkle_density;
+    stats.volume = sound_volume;
+    stats.quality = quality;
+    stats.frame_avg_ms = frame_avg + 0.5;
+    stats.sparkle_cap = sparkle_cap();
+    account_memory(&stats.memory);
+    strncpy(stats.data_set, RESOURCE_PATH, CMD_STR_SZ - 1);
+    __atomic_store_n(&stats_seq, stats_seq + 1, __ATOMIC_RELEASE);
+}
+
 static void
 putpix(SDL_Surface* surf, int x, int y, Uint32 col) {
     Uint32 *pix = (Uint32 *) surf->pixels;
     pix [ ( y * surf->w ) + x ] = col;
 }
 
+/* Find the area each cat should be centred in: one per Xinerama screen when
+   fullscreen, otherwise the whole window */
+static void
+query_layout(void) {
+#ifdef XINERAMA
+    Display* dpy;
+    XineramaScreenInfo* info;
+    int i, nn;
+#endif /* XINERAMA */
+
+    const char* display = getenv("DISPLAY");
+
+    /* Already known, e.g. from a trace being replayed */
+    if (layout_n)
+        return;
+
+    /* Saved by --write-config for the same display at the same size */
+    if (fullscreen && cached.layout_n && cached.w == screen->w && cached.h == screen->h
+        && !strcmp(cached.display, display && *display ? display : "-")) {
+        layout = cached.layout;
+        layout_n = cached.layout_n;
+        return;
+    }
+
+#ifdef XINERAMA
+
+    if (fullscreen) {
+        if (!(dpy = XOpenDisplay(NULL)))
+            puts("Failed to open Xinerama display information.");
+        else {
+            info = XineramaQueryScreens(dpy, &nn);
+            if (info && nn > 0) {
+                layout = ec_alloc(&startup_arena, sizeof(SDL_Rect) * nn);
+                for (i = 0; i < nn; ++i) {
+                    layout[i].x = info[i].x_org;
+                    layout[i].y = info[i].y_org;
+                    layout[i].w = info[i].width;
+                    layout[i].h = info[i].height;
+                }
+                layout_n = nn;
+            }
+            if (info)
+                XFree(info);
+            XCloseDisplay(dpy);
+        }
+    }
+#endif /* XINERAMA */
+
+    if (!layout_n) {
+        layout = ec_alloc(&startup_arena, sizeof(SDL_Rect));
+        layout[0].x = 0;
+        layout[0].y = 0;
+        layout[0].w = screen->w;
+        layout[0].h = screen->h;
+        layout_n = 1;
+    }
+}
+
+/* Apply "key value" lines, as written by trace_begin() or write_config(),
+   until a "begin" line or the end of @f. What they say about the machine
+   goes in @probe. */
+static void
+read_settings(FILE* f, saved_probe* probe) {
+    char line[BUF_SZ], str[BUF_SZ];
+    int x, y, w, h, n;
+    SDL_Rect* r;
+
+    while (fgets(line, BUF_SZ, f) && strcmp(line, "begin\n")) {
+        if (line[0] == '#')
+            continue;
+        else if (sscanf(line, "seed %u", &seed) == 1)
+            continue;
+        else if (sscanf(line, "screen %d %d", &w, &h) == 2) {
+            SCREEN_WIDTH = w;
+            SCREEN_HEIGHT = h;
+        }
+        else if (sscanf(line, "resolution %d %d", &w, &h) == 2)
+            set_resolution(w, h);
+        else if (sscanf(line, "dataset %1023s", str) == 1) {
+            RESOURCE_PATH = strcpy(ec_alloc(&startup_arena, strlen(str) + 1), str);
+            strcpy(probe->data_set, str);
+        }
+        else if (sscanf(line, "datadir %991[^\n]", probe->data_dir) == 1)
+            continue;
+        else if (sscanf(line, "display %1023s %d %d", probe->display, &probe->w, &probe->h) == 3)
+            continue;
+        else if (sscanf(line, "layout %d %d %d %d", &x, &y, &w, &h) == 4 && probe->layout_n < MAX_SCREENS) {
+            r = &probe->layout[probe->layout_n++];
+            r->x = x;
+            r->y = y;
+            r->w = w;
+            r->h = h;
+        }
+        else if (sscanf(line, "backend %1023s", str) == 1)
+            SURF_TYPE = strcmp(str, "sw") ? SDL_HWSURFACE : SDL_SWSURFACE;
+        else if (sscanf(line, "catsize %d", &n) == 1)
+            catsize = setting_value("catsize", n, 0, 1, catsize);
+        else if (sscanf(line, "density %d", &n) == 1)
+            sparkle_density = setting_value("density", n, 0, 1000, sparkle_density);
+        else if (sscanf(line, "budget %d", &n) == 1)
+            sparkle_budget = setting_value("budget", n, 0, INT_MAX, sparkle_budget);
+        else if (sscanf(line, "volume %d", &n) == 1)
+            sound_volume = setting_value("volume", n, 0, 128, sound_volume);
+        else if (sscanf(line, "threads %d", &n) == 1) {
+            /* 0 is one per core, as with --threads */
+            threads = setting_value("threads", n, 0, MAX_THREADS, threads);
+            if (!n)
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else {
+            sscanf(line, "fullscreen %d", &fullscreen);
+            sscanf(line, "cursor %d", &cursor);
+            sscanf(line, "sound %d", &sound);
+        }
+    }
+}
+
+/* Hand every sparkle node back to sparkle_spare and forget the bands, whose
+   list heads may be about to go with the data set's arena */
+static void
+release_sparkles(void) {
+    int i;
+
+    for (i = 0; i < band_n; ++i) {
+        list_splice_init(&bands[i].live, &sparkle_spare);
+        list_splice_init(&bands[i].pool, &sparkle_spare);
+    }
+    band_n = 0;
+    sparkle_count = 0;
+}
+
+/* Draw one frame into screen, recording how long each stage took */
+static void
+render_frame(Uint64* stage_us) {
+    Uint64 t = now_us(), t2;
+
+    arena_reset(&frame_arena);
+
+    clear_screen();
+    t2 = now_us();
+    stage_us[STAGE_CLEAR] = t2 - t;
+
+    update_sparkles();
+    t = now_us();
+    stage_us[STAGE_UPDATE] = t - t2;
+
+    draw_sparkles();
+    t2 = now_us();
+    stage_us[STAGE_SPARKLES] = t2 - t;
+
+    draw_cats(curr_frame);
+    stage_us[STAGE_CATS] = now_us() - t2;
+}
+
+/* Re-run a recorded trace as fast as possible, checking every frame against
+   the recording. Returns the number of frames that differed. */
+static int
+replay(void) {
+    static const char* stage_names[STAGES] = { "clear_screen", "update_sparkles",
+                                               "draw_sparkles", "draw_cats" };
+    Uint64 rec_total[STAGES] = { 0 }, rep_total[STAGES] = { 0 };
+    Uint64 rec_us[STAGES], rep_us[STAGES];
+    unsigned long long want_sparkles, want_screen;
+    unsigned int frame, count, first = 0;
+    char line[BUF_SZ];
+    command cmd;
+    int bad = 0;
+    int type, i;
+
+    while (running && fgets(line, BUF_SZ, trace)) {
+        memset(&cmd, 0, sizeof(command));
+        if (sscanf(line, "cmd %u %d %d %63s", &frame, &type, &cmd.arg, cmd.str) == 4) {
+            cmd.type = type;
+            if (!strcmp(cmd.str, "-"))
+                cmd.str[0] = '\0';
+            apply_command(&cmd);
+            continue;
+        }
+        if (sscanf(line, "frame %u %u %llx %llx %llu %llu %llu %llu", &frame, &count,
+                   &want_sparkles, &want_screen, (unsigned long long*) &rec_us[0],
+                   (unsigned long long*) &rec_us[1], (unsigned long long*) &rec_us[2],
+                   (unsigned long long*) &rec_us[3]) != 8)
+            continue;
+
+        /* A screen hash of 0 wasn't recorded: SDL builds blend differently,
+           so the traces for make check only pin down the sparkle state */
+        render_frame(rep_us);
+        if (count != sparkle_count || want_sparkles != sparkle_hash()
+            || (want_screen && want_screen != screen_hash())) {
+            if (!bad++) {
+                first = frame;
+                printf("First divergence at frame %u: %s\n", frame,
+                       count != sparkle_count || want_sparkles != sparkle_hash() ?
+                       "sparkle state differs" : "screen contents differ");
+            }
+        }
+        for (i = 0; i < STAGES; ++i) {
+            rec_total[i] += rec_us[i];
+            rep_total[i] += rep_us[i];
+        }
+
+        trace_frames++;
+        curr_frame++;
+        if (curr_frame >= ANIM_FRAMES_FG)
+            curr_frame = 0;
+        check_allocations(frame);
+    }
+
+    if (bad)
+        printf("Replayed %u frames, %d differed (first at frame %u)\n", trace_frames, bad, first);
+    else
+        printf("Replayed %u frames, all match\n", trace_frames);
+
+    if (!trace_frames)
+        return bad;
+    printf("%-16s %12s %12s %8s\n", "stage", "recorded us", "replayed us", "change");
+    for (i = 0; i < STAGES; ++i)
+        printf("%-16s %12.1f %12.1f %7.1f%%\n", stage_names[i],
+               (double) rec_total[i] / trace_frames, (double) rep_total[i] / trace_frames,
+               rec_total[i] ? 100.0 * rep_total[i] / rec_total[i] - 100 : 0);
+    return bad;
+}
+
+/* Fill each band's pool up to the most sparkles that can be alive in it at
+   once with the current settings, so that the render loop never allocates.
+   At most one more than weight * density / 1000 spawn per frame, and none
+   lives longer than it takes the slowest to cross the screen. */
+static void
+reserve_sparkles(void) {
+    unsigned int lifetime = (field_w + 80 + sparkle_img[0]->w) / 10 + 1;
+    unsigned int want, limit;
+    sparkle_instance* s;
+    sparkle_band* b;
+    int i;
+
+    for (i = 0; i < band_n; ++i) {
+        b = &bands[i];
+        want = (b->weight * sparkle_density / 100 / 1000 + 1) * lifetime;
+        limit = band_limit(b, sparkle_budget);
+        if (limit < want)
+            want = limit;
+
+        while (b->count + b->pooled < want) {
+            if (list_empty(&sparkle_spare)) {
+                s = ec_alloc(&startup_arena, sizeof(sparkle_instance));
+                sparkle_nodes++;
+            }
+            else {
+                s = list_entry(sparkle_spare.next, sparkle_instance, list);
+                list_del(&s->list);
+            }
+            list_add(&s->list, &b->pool);
+            b->pooled++;
+        }
+    }
+}
+
 static void
 restart_music(void) {
     Mix_PlayMusic(music, 0);
 }
 
+/* Roughly what SDL keeps for an RLE encoded surface: a four byte header
+   for each run of visible pixels and each row, and the pixels themselves */
+static unsigned long
+rle_bytes(SDL_Surface* surf) {
+    Uint32 amask = surf->format->Amask;
+    unsigned long bytes = 0;
+    Uint32* row;
+    int x, y, visible;
+
+    SDL_LockSurface(surf);
+    for (y = 0; y < surf->h; ++y) {
+        row = (Uint32*) ((Uint8*) surf->pixels + y * surf->pitch);
+        visible = 0;
+        for (x = 0; x < surf->w; ++x) {
+            if (!amask || (row[x] & amask)) {
+                bytes += visible ? 4 : 8;
+                visible = 1;
+            }
+            else
+                visible = 0;
+        }
+        bytes += 4;
+    }
+    SDL_UnlockSurface(surf);
+    return bytes;
+}
+
 static void
 run(void) {
     unsigned int last_draw, draw_time;
+    Uint64 stage_us[STAGES];
 
     while( running ) {
         last_draw = SDL_GetTicks();
 
-        clear_screen();
-        update_sparkles();
-        draw_sparkles();
-        draw_cats(curr_frame);
+        handle_commands();
+        if (!running)
+            break;
+
+        render_frame(stage_us);
+        if (tracing == TRACE_RECORD) {
+            fprintf(trace, "frame %u %u %016llx %016llx %llu %llu %llu %llu\n",
+                    trace_frames, sparkle_count, (unsigned long long) sparkle_hash(),
+                    (unsigned long long) screen_hash(),
+                    (unsigned long long) stage_us[STAGE_CLEAR],
+                    (unsigned long long) stage_us[STAGE_UPDATE],
+                    (unsigned long long) stage_us[STAGE_SPARKLES],
+                    (unsigned long long) stage_us[STAGE_CATS]);
+            trace_frames++;
+        }
 
-        handle_input();
+        if (pump_events)
+            SDL_PumpEvents();
         SDL_Flip(screen);
 
         /* Frame increment and looping */
@@ -486,58 +1952,596 @@ run(void) {
             curr_frame = 0;
 
         draw_time = SDL_GetTicks() - last_draw;
+        govern_quality(draw_time);
+        publish_stats(draw_time);
+        check_allocations(stats.frames);
         if (draw_time < (1000 / FRAMERATE))
             SDL_Delay((1000 / FRAMERATE) - draw_time);
     }
 }
 
+/* Time update_sparkles() alone on 1 to threads threads, over screens up to a
+   16K tall video wall. Every thread count must end in the same state. */
+static void
+run_benchmark(void) {
+    static const struct {
+        const char* name;
+        int w, h;
+    } fields[] = {
+        { "1080p", 1920, 1080 },
+        { "4K", 3840, 2160 },
+        { "16K tall", 1920, 16384 },
+    };
+    int max = threads, i, t, f;
+    Uint64 start, us, base = 1, hash = 0;
+
+    printf("%-10s %7s %7s %9s %12s %8s\n", "screen", "bands", "threads", "sparkles",
+           "us/frame", "speedup");
+    for (i = 0; i < (int) (sizeof(fields) / sizeof(fields[0])); ++i) {
+        field_w = fields[i].w;
+        field_h = fields[i].h;
+        for (t = 1; t <= max; ++t) {
+            threads = t;
+            srand(seed);
+            setup_bands();
+            warmup_sparkles();
+            reserve_sparkles();
+
+            start = now_us();
+            for (f = 0; f < BENCH_FRAMES; ++f)
+                update_sparkles();
+            us = now_us() - start;
+
+            if (t == 1) {
+                base = us ? us : 1;
+                hash = sparkle_hash();
+            }
+            printf("%-10s %7d %7d %9u %12.2f %7.2fx%s\n", fields[i].name, band_n, t,
+                   sparkle_count, (double) us / BENCH_FRAMES, (double) base / (us ? us : 1),
+                   sparkle_hash() == hash ? "" : "  DIFFERENT");
+        }
+    }
+}
+
+static Uint64
+screen_hash(void) {
+    Uint64 hash = FNV_OFFSET;
+    int y;
+
+    for (y = 0; y < screen->h; ++y)
+        hash = fnv1a(hash, (Uint8*) screen->pixels + y * screen->pitch, screen->w * 4);
+    return hash;
+}
+
+/* Also works out the frame deltas for both cat sizes up front, so that the
+   quality governor can switch between them without allocating */
+static void
+select_image_set(void) {
+    small_delta = build_cat_deltas(cat_img);
+    full_delta = NULL;
+    if (catsize == 1) {
+        stretch_images();
+        full_delta = build_cat_deltas(stretch_cat);
+    }
+
+    /* Room for every cat's spans and dirty rects in cat_dirty() */
+    if (!arena_reserve(&frame_arena, layout_n * (sizeof(int) * 2 + sizeof(SDL_Rect) + ARENA_ALIGN)
+                       * ((catsize == 1 ? stretch_cat : cat_img)[0]->h + CAT_BOB)))
+        errout("Unable to reserve frame memory.");
+
+    if (catsize == 1 && quality_levels[quality].full_cat) {
+        image_set = stretch_cat;
+        cat_delta = full_delta;
+    }
+    else {
+        image_set = cat_img;
+        cat_delta = small_delta;
+    }
+}
+
+static void
+set_resolution(int w, int h) {
+    if (w >= 0 && w < 10000 && h >= 0 && h < 5000) {           // Borrowed from PixelUnsticker, changed the variable name
+        SCREEN_WIDTH = w;
+        SCREEN_HEIGHT = h;
+    }
+    else
+        puts("Arguments do not appear to be valid screen sizes. Defaulting.");
+}
+
+/* Settings files are edited by hand, so hold them to the same bounds as the
+   command line and control socket */
+static int
+setting_value(const char* name, int n, int min, int max, int fallback) {
+    if (n >= min && n <= max)
+        return n;
+    printf("Setting %s must be from %d to %d. Using %d.\n", name, min, max, fallback);
+    return fallback;
+}
+
+/* Split the spawn area, from one sparkle height above the screen to its
+   bottom, into bands of SPARKLE_BAND rows. Each band's random stream is
+   seeded from rand() in order so a run depends only on the seed. */
+static void
+setup_bands(void) {
+    int sh = sparkle_img[0]->h;
+    int span = field_h + sh;
+    sparkle_band* b;
+    int i;
+
+    release_sparkles();
+    band_n = (span + SPARKLE_BAND - 1) / SPARKLE_BAND;
+    bands = ec_alloc(&data_arena, sizeof(sparkle_band) * band_n);
+    for (i = 0; i < band_n; ++i) {
+        b = &bands[i];
+        b->top = i * SPARKLE_BAND - sh;
+        b->rows = i == band_n - 1 ? span - i * SPARKLE_BAND : SPARKLE_BAND;
+        /* Together the weights make up the screen height, as one draw did */
+        b->weight = (long long) field_h * (i * SPARKLE_BAND + b->rows) / span
+                    - (long long) field_h * i * SPARKLE_BAND / span;
+        if (b->weight < 1)
+            b->weight = 1;
+        b->rng = rand();
+        b->spawn_counter = 0;
+        b->count = 0;
+        b->pooled = 0;
+        INIT_LIST_HEAD(&b->live);
+        INIT_LIST_HEAD(&b->pool);
+    }
+}
+
+/* The live sparkle limit: the smaller of the user's budget and the one set
+   by the quality level, or 0 if neither applies */
+static unsigned int
+sparkle_cap(void) {
+    unsigned int cap = quality_levels[quality].max_sparkles;
+
+    if (sparkle_budget && (!cap || sparkle_budget < cap))
+        cap = sparkle_budget;
+    return cap;
+}
+
+static Uint64
+sparkle_hash(void) {
+    Uint64 hash = FNV_OFFSET;
+    sparkle_instance* s;
+    int state[6];
+    int i;
+
+    for_each_sparkle(s, i) {
+        state[0] = s->loc.x;
+        state[1] = s->loc.y;
+        state[2] = s->frame;
+        state[3] = s->frame_mov;
+        state[4] = s->speed;
+        state[5] = s->layer;
+        hash = fnv1a(hash, state, sizeof(state));
+    }
+    return hash;
+}
+
+/* Helps update_sparkles() with each frame's bands until told to quit */
+static int
+sparkle_worker(void* unused) {
+#ifdef DEBUG_ALLOC
+    counting = 1;
+#endif /* DEBUG_ALLOC */
+    for (;;) {
+        SDL_SemWait(work_sem);
+        if (workers_quit)
+            break;
+        update_bands();
+        SDL_SemPost(done_sem);
+    }
+    return 0;
+}
+
+/* Advance @b's spawn counter one step, spawning as add_sparkle(@age) while
+   the band has fewer than @cap sparkles */
+static void
+spawn_sparkles(sparkle_band* b, unsigned int cap, unsigned int age) {
+    b->spawn_counter += (rand_r(&b->rng) % b->weight) * sparkle_density / 100
+                        * quality_levels[quality].density / 100;
+    while(b->spawn_counter >= 1000) {
+        if (b->count < cap)
+            add_sparkle(b, age);
+        b->spawn_counter -= 1000;
+    }
+}
+
+/* Map the decoded frames for the current data set from a POSIX shared memory
+   segment, building it first if no other instance has. Returns 0 if the
+   segment can't be used, in which case the caller loads privately. */
+static int
+shared_attach(void) {
+    static int registered = 0;
+    struct stat st;
+    long pagesz = sysconf(_SC_PAGESIZE);
+    SDL_PixelFormat* fmt = screen->format;
+    char* c;
+    int i;
+
+    if (ANIM_FRAMES_FG + ANIM_FRAMES_BG > SHM_MAX_FRAMES || fmt->BytesPerPixel != 4)
+        return 0;
+
+    snprintf(shm_name, BUF_SZ, "/nyancat-%s", RESOURCE_PATH);
+    for (c = shm_name + 1; *c; ++c)
+        if (*c == '/')
+            *c = '_';
+
+    shm_hdr_size = (sizeof(shared_header) + pagesz - 1) / pagesz * pagesz;
+    for (;;) {
+        shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+        if (shm_fd < 0) {
+            perror("shm_open");
+            return 0;
+        }
+
+        shared_lock(F_WRLCK, SHM_LOCK_BUSY, 1);
+        if (fstat(shm_fd, &st) < 0)
+            goto fail;
+
+        /* Its last user unlinked it between our open and lock; start again */
+        if (st.st_nlink > 0)
+            break;
+        close(shm_fd);
+    }
+
+    if ((size_t) st.st_size < shm_hdr_size) {
+        if (!shared_build(shm_fd))
+            goto discard;
+    }
+    else {
+        shm_hdr = mmap(NULL, shm_hdr_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (shm_hdr == MAP_FAILED) {
+            shm_hdr = NULL;
+            goto fail;
+        }
+        /* A creator that died half way leaves a bad magic behind; take over */
+        if (shm_hdr->magic != SHM_MAGIC) {
+            munmap(shm_hdr, shm_hdr_size);
+            shm_hdr = NULL;
+            if (!shared_build(shm_fd))
+                goto discard;
+        }
+        else if (shm_hdr->Rmask != fmt->Rmask || shm_hdr->Gmask != fmt->Gmask ||
+                 shm_hdr->Bmask != fmt->Bmask || shm_hdr->Amask != fmt->Amask ||
+                 shm_hdr->frames_fg != ANIM_FRAMES_FG || shm_hdr->frames_bg != ANIM_FRAMES_BG) {
+            puts("Shared asset segment does not match this display. Loading privately.");
+            goto fail;
+        }
+        else {
+            shm_data = mmap(NULL, shm_hdr->data_size, PROT_READ, MAP_SHARED, shm_fd, shm_hdr_size);
+            if (shm_data == MAP_FAILED) {
+                shm_data = NULL;
+                goto fail;
+            }
+        }
+    }
+
+    shared_lock(F_RDLCK, SHM_LOCK_USERS, 1);
+    shared_lock(F_UNLCK, SHM_LOCK_BUSY, 1);
+    if (!registered) {
+        atexit(shared_detach);
+        registered = 1;
+    }
+
+    for (i = 0; i < ANIM_FRAMES_FG + ANIM_FRAMES_BG; ++i) {
+        shared_frame* f = &shm_hdr->frames[i];
+        SDL_Surface* surf = SDL_CreateRGBSurfaceFrom(shm_data + f->offset, f->w, f->h, 32,
+            f->pitch, fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask);
+        if (!surf)
+            errout("Error creating surfaces from shared asset segment.");
+        SDL_SetAlpha(surf, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+        if (i < ANIM_FRAMES_FG)
+            cat_img[i] = surf;
+        else
+            sparkle_img[i - ANIM_FRAMES_FG] = surf;
+    }
+
+    printf("Using shared asset segment %s (%u bytes)\n", shm_name, shm_hdr->data_size);
+    return 1;
+
+    /* Nobody can be using a segment we failed to build, and we still hold
+       SHM_LOCK_BUSY, so nobody can be about to */
+discard:
+    shm_unlink(shm_name);
+fail:
+    if (shm_hdr)
+        munmap(shm_hdr, shm_hdr_size);
+    shm_hdr = NULL;
+    close(shm_fd);
+    shm_fd = -1;
+    return 0;
+}
+
+/* Decode everything privately, then copy it into a freshly sized segment.
+   Called with the segment lock held. */
+static int
+shared_build(int fd) {
+    SDL_PixelFormat* fmt = screen->format;
+    SDL_Surface* surf;
+    unsigned char* ogg;
+    Uint32 ogg_size = 0;
+    Uint32 size = 0;
+    int i, row;
+
+    load_frames();
+    ogg = low_memory ? NULL : map_resource("music.ogg", &ogg_size);
+
+    for (i = 0; i < ANIM_FRAMES_FG + ANIM_FRAMES_BG; ++i) {
+        surf = i < ANIM_FRAMES_FG ? cat_img[i] : sparkle_img[i - ANIM_FRAMES_FG];
+        size += surf->w * 4 * surf->h;
+    }
+    size += ogg_size;
+
+    if (ftruncate(fd, shm_hdr_size + size) < 0)
+        goto fail;
+    shm_hdr = mmap(NULL, shm_hdr_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm_hdr == MAP_FAILED) {
+        shm_hdr = NULL;
+        goto fail;
+    }
+    shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, shm_hdr_size);
+    if (shm_data == MAP_FAILED) {
+        shm_data = NULL;
+        goto fail;
+    }
+
+    memset(shm_hdr, 0, sizeof(shared_header));
+    shm_hdr->Rmask = fmt->Rmask;
+    shm_hdr->Gmask = fmt->Gmask;
+    shm_hdr->Bmask = fmt->Bmask;
+    shm_hdr->Amask = fmt->Amask;
+    shm_hdr->frames_fg = ANIM_FRAMES_FG;
+    shm_hdr->frames_bg = ANIM_FRAMES_BG;
+    shm_hdr->data_size = size;
+
+    /* Repack rows tightly; the surface pitch may include padding */
+    size = 0;
+    for (i = 0; i < ANIM_FRAMES_FG + ANIM_FRAMES_BG; ++i) {
+        surf = i < ANIM_FRAMES_FG ? cat_img[i] : sparkle_img[i - ANIM_FRAMES_FG];
+        shm_hdr->frames[i].w = surf->w;
+        shm_hdr->frames[i].h = surf->h;
+        shm_hdr->frames[i].pitch = surf->w * 4;
+        shm_hdr->frames[i].offset = size;
+        SDL_LockSurface(surf);
+        for (row = 0; row < surf->h; ++row)
+            memcpy(shm_data + size + row * surf->w * 4,
+                   (unsigned char*) surf->pixels + row * surf->pitch, surf->w * 4);
+        SDL_UnlockSurface(surf);
+        size += surf->w * 4 * surf->h;
+        SDL_FreeSurface(surf);
+    }
+    if (ogg) {
+        memcpy(shm_data + size, ogg, ogg_size);
+        shm_hdr->music_offset = size;
+        shm_hdr->music_size = ogg_size;
+        munmap(ogg, ogg_size);
+    }
+
+    /* Nobody writes to the pixels after this point, including us */
+    mprotect(shm_data, shm_hdr->data_size, PROT_READ);
+    shm_hdr->magic = SHM_MAGIC;
+    return 1;
+
+fail:
+    perror("Unable to create shared asset segment");
+    if (shm_data)
+        munmap(shm_data, size);
+    shm_data = NULL;
+    if (shm_hdr)
+        munmap(shm_hdr, shm_hdr_size);
+    shm_hdr = NULL;
+    if (ogg)
+        munmap(ogg, ogg_size);
+    for (i = 0; i < ANIM_FRAMES_FG; ++i)
+        SDL_FreeSurface(cat_img[i]);
+    for (i = 0; i < ANIM_FRAMES_BG; ++i)
+        SDL_FreeSurface(sparkle_img[i]);
+    return 0;
+}
+
+static void
+shared_detach(void) {
+    struct stat st;
+
+    if (!shm_hdr)
+        return;
+
+    munmap(shm_data, shm_hdr->data_size);
+    munmap(shm_hdr, shm_hdr_size);
+
+    /* Only the last user gets the write lock, and a killed instance's read
+       lock goes with it. A segment that has already been unlinked is left
+       alone, as the name may now be someone else's. */
+    shared_lock(F_WRLCK, SHM_LOCK_BUSY, 1);
+    if (!shared_lock(F_WRLCK, SHM_LOCK_USERS, 0) && !fstat(shm_fd, &st) && st.st_nlink > 0)
+        shm_unlink(shm_name);
+    close(shm_fd);      /* Drops all our locks on it */
+    shm_hdr = NULL;
+    shm_data = NULL;
+    shm_fd = -1;
+}
+
+/* Lock or unlock one byte of the segment for this process */
+static int
+shared_lock(short type, off_t byte, int wait) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    return fcntl(shm_fd, wait ? F_SETLKW : F_SETLK, &fl);
+}
+
 static void
 stretch_images(void) {
+    SDL_PixelFormat* fmt = cat_img[0]->format;
     SDL_Rect stretchto;
-    stretchto.w = 0;
-    stretchto.h = 0;
+    int i;
 
     /*  Just use the x co-ordinate for scaling for now. This does, however,
         need to be changed to accomodate taller resolutions */
-#ifdef XINERAMA
-    int i, nn;
-    XineramaScreenInfo* info = XineramaQueryScreens(dpy, &nn);
-
-    for (i = 0; i < nn; ++i) {
-        if(!stretchto.w || info[i].width < stretchto.w)
-            stretchto.w = info[i].width;
-    }
-
-    XFree(info);
-#endif /* XINERAMA */
-    if (!stretchto.w)
-        stretchto.w = screen->w;
+    stretchto.w = 0;
+    for (i = 0; i < layout_n; ++i)
+        if (!stretchto.w || layout[i].w < stretchto.w)
+            stretchto.w = layout[i].w;
 
     /* Handle a slight scaling down */
     stretchto.w *= 0.9;
     stretchto.h = stretchto.w * cat_img[0]->h / cat_img[0]->w;
 
-    SDL_PixelFormat fmt = *(cat_img[0]->format);
-    for (int i=0; i <= ANIM_FRAMES_FG; i++) {
+    stretch_cat = ec_alloc(&data_arena, sizeof(SDL_Surface*) * ANIM_FRAMES_FG);
+
+    if (stretch_lru) {
+        for (i = 0; i < STRETCH_SLOTS; i++) {
+            stretch_slot[i] = SDL_CreateRGBSurface(SURF_TYPE, stretchto.w,
+                stretchto.h,SCREEN_BPP,fmt->Rmask,fmt->Gmask,fmt->Bmask,fmt->Amask);
+            slot_frame[i] = -1;
+            slot_used[i] = 0;
+            scaled_bytes += stretch_slot[i]->h * stretch_slot[i]->pitch;
+        }
+        for (i = 0; i < ANIM_FRAMES_FG; i++)
+            stretch_cat[i] = stretch_slot[0];
+        return;
+    }
+
+    for (i = 0; i < ANIM_FRAMES_FG; i++) {
         stretch_cat[i] = SDL_CreateRGBSurface(SURF_TYPE, stretchto.w,
-            stretchto.h,SCREEN_BPP,fmt.Rmask,fmt.Gmask,fmt.Bmask,fmt.Amask);
+            stretchto.h,SCREEN_BPP,fmt->Rmask,fmt->Gmask,fmt->Bmask,fmt->Amask);
         SDL_SoftStretch(cat_img[i],NULL,stretch_cat[i],NULL);
+        scaled_bytes += stretch_cat[i]->h * stretch_cat[i]->pitch;
     }
+}
 
+/* Replace the running data set. Called from the render loop between frames. */
+static void
+switch_data_set(const char* name) {
+    if (!data_set_exists(name)) {
+        printf("No such data set: %s\n", name);
+        return;
+    }
+
+    if (sound) {
+        Mix_HookMusicFinished(NULL);
+        Mix_HaltMusic();
+        Mix_FreeMusic(music);
+        music = NULL;
+        if (music_rw)
+            SDL_FreeRW(music_rw);
+        music_rw = NULL;
+    }
+
+    release_sparkles();
+    unload_images();
+
+    /* The old name went with the data set's arena */
+    RESOURCE_PATH = strcpy(ec_alloc(&data_arena, strlen(name) + 1), name);
+    load_resource_data();
+    load_images();
+    select_image_set();
+    place_cats();
+
+    curr_frame = 0;
+    fillsquare(screen, 0, 0, screen->w, screen->h, bgcolor);
+    setup_bands();
+    warmup_sparkles();
+    reserve_sparkles();
+
+    if (sound) {
+        load_music();
+        Mix_PlayMusic(music, 0);
+        Mix_VolumeMusic(sound_volume);
+    }
+    if (show_memory)
+        print_memory();
 }
 
+/* Write everything replay needs to reproduce this run. Called once init() has
+   settled the screen, layout and sparkles. */
 static void
-update_sparkles(void) {
+trace_begin(void) {
+    int i;
+
+    trace = fopen(trace_path, "w");
+    if (!trace)
+        errout("Unable to open trace file for writing.");
+
+    fprintf(trace, "%s\nargs", TRACE_MAGIC);
+    for (i = 1; i < arg_count; ++i)
+        fprintf(trace, " %s", arg_values[i]);
+    fprintf(trace, "\nseed %u\nscreen %d %d\ndataset %s\ncatsize %d\ndensity %d\nbudget %u\n",
+            seed, screen->w, screen->h, RESOURCE_PATH, catsize, sparkle_density, sparkle_budget);
+    for (i = 0; i < layout_n; ++i)
+        fprintf(trace, "layout %d %d %d %d\n", layout[i].x, layout[i].y, layout[i].w, layout[i].h);
+    fprintf(trace, "begin\n");
+}
+
+/* Read a trace header and set everything up to re-run it headlessly */
+static void
+trace_load(void) {
+    char line[BUF_SZ];
+    saved_probe probe;
+
+    trace = fopen(trace_path, "r");
+    if (!trace || !fgets(line, BUF_SZ, trace) || strncmp(line, TRACE_MAGIC, strlen(TRACE_MAGIC)))
+        errout("Unable to read trace file.");
+
+    /* A trace's layout is what was drawn on, not a guess to be checked */
+    memset(&probe, 0, sizeof(probe));
+    read_settings(trace, &probe);
+    if (probe.layout_n) {
+        layout_n = probe.layout_n;
+        layout = ec_alloc(&startup_arena, sizeof(SDL_Rect) * layout_n);
+        memcpy(layout, probe.layout, sizeof(SDL_Rect) * layout_n);
+    }
+
+    headless();
+}
+
+static void
+unload_images(void) {
+    int i;
+
+    for (i = 0; i < ANIM_FRAMES_FG; ++i) {
+        SDL_FreeSurface(cat_img[i]);
+        if (stretch_cat && !stretch_lru)
+            SDL_FreeSurface(stretch_cat[i]);
+    }
+    if (stretch_cat && stretch_lru)
+        for (i = 0; i < STRETCH_SLOTS; ++i)
+            SDL_FreeSurface(stretch_slot[i]);
+    for (i = 0; i < ANIM_FRAMES_BG; ++i)
+        SDL_FreeSurface(sparkle_img[i]);
+
+    arena_reset(&data_arena);
+    cat_img = NULL;
+    sparkle_img = NULL;
+    stretch_cat = NULL;
+    image_set = NULL;
+    cat_delta = NULL;
+    small_delta = NULL;
+    full_delta = NULL;
+    stretch_lru = 0;
+    sprite_bytes = 0;
+    scaled_bytes = 0;
+    delta_bytes = 0;
+
+    /* Surfaces built on the shared segment don't own their pixels */
+    shared_detach();
+}
+
+static void
+update_band(sparkle_band* b) {
     sparkle_instance *s;
     sparkle_instance *tmp;
 
-    sparkle_spawn_counter += rand() % screen->h;
-    while(sparkle_spawn_counter >= 1000) {
-        add_sparkle();
-        sparkle_spawn_counter -= 1000;
-    }
+    spawn_sparkles(b, band_limit(b, sparkle_cap()), 0);
 
-    list_for_each_entry_safe(s, tmp, &sparkle_list, list) {
+    list_for_each_entry_safe(s, tmp, &b->live, list) {
         s->loc.x -= s->speed;
         s->frame += s->frame_mov;
 
@@ -545,12 +2549,37 @@ update_sparkles(void) {
             s->frame_mov = 0 - s->frame_mov;
 
         if (s->loc.x < 0 - sparkle_img[0]->w) {
-            list_del(&s->list);
-            free(s);
+            list_move(&s->list, &b->pool);
+            b->count--;
+            b->pooled++;
         }
     }
 }
 
+/* Take bands until none are left for this frame */
+static void
+update_bands(void) {
+    int i;
+
+    while ((i = __atomic_fetch_add(&next_band, 1, __ATOMIC_RELAXED)) < band_n)
+        update_band(&bands[i]);
+}
+
+/* Bands are shared out between this thread and threads - 1 workers */
+static void
+update_sparkles(void) {
+    int helpers = (threads < band_n ? threads : band_n) - 1;
+    int i;
+
+    next_band = 0;
+    for (i = 0; i < helpers; ++i)
+        SDL_SemPost(work_sem);
+    update_bands();
+    for (i = 0; i < helpers; ++i)
+        SDL_SemWait(done_sem);
+    count_sparkles();
+}
+
 static void
 usage(char* exname) {
     printf("Usage: %s [OPTIONS]\n\
@@ -570,36 +2599,107 @@ usage(char* exname) {
     -d, --data-set                 Use an alternate data set. Packaged with\n\
                                    this program by default are \"default\"\n\
                                    and \"freedom\" sets.\n\
+    -nd, --nodelta                 Redraw the whole cat every frame instead\n\
+                                   of only the parts that changed\n\
+    -sh, --shared                  Share decoded images and music with other\n\
+                                   instances using the same data set\n\
+    -b,  --budget                  Never show more than the next argument\n\
+                                   sparkles at once (0 for no limit)\n\
+    -na, --noadaptive              Don't lower quality to keep up the frame\n\
+                                   rate\n\
+    -t,  --threads                 Update sparkles on the next argument\n\
+                                   threads (0 for one per core, 1 default)\n\
+    -bm, --benchmark               Time the sparkle update on 1 to --threads\n\
+                                   threads at several screen sizes and exit\n\
+    -lm, --lowmem                  Use less memory at the cost of more CPU\n\
+                                   time: compressed images, full size cat\n\
+                                   frames stretched when needed, and music\n\
+                                   always streamed from its file\n\
+    -m,  --memory                  Print how much memory each part uses\n\
+    -rec, --record                 Record a trace of every frame to the file\n\
+                                   given as the next argument\n\
+    -rep, --replay                 Re-run the trace in the next argument\n\
+                                   without a display and report differences\n\
+    -s,  --socket                  Listen for control commands on the UNIX\n\
+                                   socket at the next argument\n\
+    -rc, --config                  Read settings from the next argument\n\
+                                   instead of ~/.nyancatrc\n\
+    -nrc, --noconfig               Don't read a settings file\n\
+    -wc, --write-config            Save this run's settings, data set\n\
+                                   location and screen layout to the\n\
+                                   settings file\n\
     -hw, -sw                       Use hardware or software SDL rendering, \n\
                                    respectively. Hardware is default\n", exname);
     exit(0);
 }
 
-#ifdef XINERAMA
+/* Pre-populate with the sparkles WARMUP_STEPS calls to update_sparkles() would
+   leave on screen. Each step's spawns are placed straight at their final
+   position and frame, and those that would already have left are never
+   allocated. */
 static void
-xinerama_add_cats(void) {
-    int i, nn;
-    XineramaScreenInfo* info = XineramaQueryScreens(dpy, &nn);
+warmup_sparkles(void) {
+    unsigned int cap;
+    int age, i;
+
+    for (i = 0; i < band_n; ++i) {
+        cap = band_limit(&bands[i], sparkle_cap());
+        for (age = WARMUP_STEPS; age > 0; --age)
+            spawn_sparkles(&bands[i], cap, age);
+    }
+    count_sparkles();
+}
 
-    for (i = 0; i < nn; ++i) {
-        if(fullscreen) {
-            add_cat(info[i].x_org + ((info[i].width - image_set[0]->w) / 2),
-                info[i].y_org + ((info[i].height - image_set[0]->h) / 2));
-        }
-        else {
-            add_cat((SCREEN_WIDTH - image_set[0]->w) / 2, 
-                (SCREEN_HEIGHT - image_set[0]->h) / 2);
-        }
+/* Save the settings this run ended up with to rc_path, along with where the
+   data set was found and the screen layout, so that the next start with
+   nothing changed can skip looking for them */
+static void
+write_config(void) {
+    const char* display = getenv("DISPLAY");
+    char dir[PATH_MAX];
+    FILE* f;
+    int i;
+
+    if (!rc_path || !(f = fopen(rc_path, "w"))) {
+        printf("Unable to write settings to %s\n", rc_path ? rc_path : "$HOME/.nyancatrc");
+        return;
     }
 
-    XFree(info);
+    fprintf(f, "# Written by nyancat --write-config\n");
+    fprintf(f, "resolution %u %u\nfullscreen %d\ncatsize %d\ncursor %d\nsound %d\nvolume %d\n",
+            SCREEN_WIDTH, SCREEN_HEIGHT, fullscreen, catsize, cursor, sound, sound_volume);
+    fprintf(f, "backend %s\nthreads %d\nbudget %u\ndensity %d\ndataset %s\n",
+            SURF_TYPE == SDL_SWSURFACE ? "sw" : "hw", threads, sparkle_budget, sparkle_density,
+            RESOURCE_PATH);
+    if (realpath(data_dir, dir))
+        fprintf(f, "datadir %s\n", dir);
+    if (fullscreen) {
+        fprintf(f, "display %s %d %d\n", display && *display ? display : "-", screen->w, screen->h);
+        for (i = 0; i < layout_n; ++i)
+            fprintf(f, "layout %d %d %d %d\n", layout[i].x, layout[i].y, layout[i].w, layout[i].h);
+    }
+    fclose(f);
+    printf("Saved settings to %s\n", rc_path);
 }
-#endif /* XINERAMA */
 
 int main( int argc, char **argv ) {
+    int bad = 0;
+
+    load_config(argc, argv);
     handle_args(argc, argv);
+    if (tracing != TRACE_NONE || benchmark)
+        adaptive = 0;
+    if (tracing == TRACE_REPLAY)
+        trace_load();
+    else if (benchmark)
+        headless();
     init();
-    run();
+    if (tracing == TRACE_REPLAY)
+        bad = replay();
+    else if (benchmark)
+        run_benchmark();
+    else
+        run();
     cleanup();
-    return 0;
+    return bad ? 1 : 0;
 }
@@ -0,0 +1,73 @@
+#ifndef __RING_H
+#define __RING_H
+
+/*
+ * Lock-free single producer, single consumer ring buffer.
+ *
+ * One thread may call ring_push() and one other thread may call ring_pop()
+ * at the same time without any locking. The element size is fixed when the
+ * ring is initialised and the number of slots must be a power of two.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+struct ring {
+    unsigned int head;      /* Next slot to write, owned by the producer */
+    unsigned int tail;      /* Next slot to read, owned by the consumer */
+    unsigned int mask;
+    size_t esize;
+    unsigned char *buf;
+};
+
+/**
+ * ring_init - prepare a ring for use
+ * @r: the ring.
+ * @buf: storage for @slots elements of @esize bytes.
+ * @esize: size of one element.
+ * @slots: number of slots, a power of two.
+ */
+static inline void
+ring_init(struct ring *r, void *buf, size_t esize, unsigned int slots) {
+    r->head = 0;
+    r->tail = 0;
+    r->mask = slots - 1;
+    r->esize = esize;
+    r->buf = buf;
+}
+
+/**
+ * ring_push - copy an element into the ring
+ * @r: the ring.
+ * @e: the element to copy in.
+ * Returns false if the ring is full. Producer side only.
+ */
+static inline bool
+ring_push(struct ring *r, const void *e) {
+    unsigned int head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+        return false;
+    memcpy(r->buf + (head & r->mask) * r->esize, e, r->esize);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * ring_pop - copy the oldest element out of the ring
+ * @r: the ring.
+ * @e: where to copy the element to.
+ * Returns false if the ring is empty. Consumer side only.
+ */
+static inline bool
+ring_pop(struct ring *r, void *e) {
+    unsigned int tail = r->tail;
+
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        return false;
+    memcpy(e, r->buf + (tail & r->mask) * r->esize, r->esize);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif